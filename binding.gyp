@@ -0,0 +1,11 @@
+{
+  "targets": [
+    {
+      "target_name": "bfvm",
+      "sources": ["lib/vm/bfvm_addon.c", "lib/vm/bf_vm.c"],
+      "include_dirs": ["lib/vm"],
+      "cflags": ["-O3", "-std=gnu11"],
+      "xcode_settings": { "OTHER_CFLAGS": ["-O3", "-std=gnu11"] }
+    }
+  ]
+}
@@ -0,0 +1,169 @@
+// lib/cache.js - RESULT MEMOIZATION FOR execute()
+
+const fs = require('fs');
+const path = require('path');
+const crypto = require('crypto');
+
+const DEFAULT_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+
+// --- Backing Stores ---
+// A store only holds bytes by key; eviction order is decided by ResultCache.
+// Interface: async get(key) -> Buffer|undefined, async set(key, Buffer),
+// async delete(key), async entries() -> [{ key, size }] oldest first.
+
+class MemoryStore {
+    constructor() {
+        this.map = new Map();
+    }
+    async get(key) { return this.map.get(key); }
+    async set(key, value) { this.map.set(key, value); }
+    async delete(key) { this.map.delete(key); }
+    async entries() {
+        return [...this.map].map(([key, value]) => ({ key, size: value.length }));
+    }
+}
+
+class FileStore {
+    /**
+     * @param {string} dir Directory holding one file per entry (created if missing).
+     */
+    constructor(dir) {
+        this.dir = dir;
+        fs.mkdirSync(dir, { recursive: true });
+    }
+    filePath(key) { return path.join(this.dir, `${key}.json`); }
+    async get(key) {
+        let value;
+        try {
+            value = await fs.promises.readFile(this.filePath(key));
+        } catch (err) {
+            if (err.code === 'ENOENT') return undefined;
+            throw err;
+        }
+        // entries() orders by mtime, so a hit has to touch the file for LRU order
+        // to survive a restart (a failed touch only costs that order)
+        const now = new Date();
+        await fs.promises.utimes(this.filePath(key), now, now).catch(() => {});
+        return value;
+    }
+    async set(key, value) {
+        // Write-then-rename so readers never see a partial entry; the temp name is
+        // unique per write, so concurrent sets of one key don't share a file
+        const tmp = `${this.filePath(key)}.${process.pid}.${crypto.randomUUID()}.tmp`;
+        try {
+            await fs.promises.writeFile(tmp, value);
+            await fs.promises.rename(tmp, this.filePath(key));
+        } catch (err) {
+            await fs.promises.rm(tmp, { force: true });
+            throw err;
+        }
+    }
+    async delete(key) {
+        await fs.promises.rm(this.filePath(key), { force: true });
+    }
+    async entries() {
+        const names = (await fs.promises.readdir(this.dir)).filter(name => name.endsWith('.json'));
+        const stats = await Promise.all(names.map(async name => {
+            const stat = await fs.promises.stat(path.join(this.dir, name));
+            return { key: name.slice(0, -'.json'.length), size: stat.size, mtime: stat.mtimeMs };
+        }));
+        return stats.sort((a, b) => a.mtime - b.mtime);
+    }
+}
+
+// --- LRU Result Cache ---
+class ResultCache {
+    /**
+     * @param {object} [options={}]
+     * @param {number} [options.maxBytes=DEFAULT_CACHE_MAX_BYTES] Upper bound on stored result bytes.
+     * @param {object} [options.store=new MemoryStore()] Backing store (MemoryStore, FileStore or compatible).
+     */
+    constructor(options = {}) {
+        this.maxBytes = options.maxBytes ?? DEFAULT_CACHE_MAX_BYTES;
+        this.store = options.store ?? new MemoryStore();
+        this.index = new Map(); // key -> size, in LRU order (oldest first)
+        this.totalBytes = 0;
+        this.hits = 0;
+        this.misses = 0;
+        this.loading = null;
+
+        if (this.maxBytes <= 0) throw new Error("Invalid option: maxBytes must be positive.");
+    }
+
+    // Everything that determines the output of a run. The engine is left out on
+    // purpose: all engines produce identical results.
+    static keyFor(code, input, memorySize, maxOutputSize) {
+        return crypto.createHash('sha256')
+            .update(JSON.stringify([code, input, memorySize, maxOutputSize]))
+            .digest('hex');
+    }
+
+    // Picks up entries a persistent store already holds (once, on first use).
+    async load() {
+        if (!this.loading) {
+            this.loading = (async () => {
+                for (const { key, size } of await this.store.entries()) {
+                    this.index.set(key, size);
+                    this.totalBytes += size;
+                }
+                await this.evict();
+            })();
+        }
+        return this.loading;
+    }
+
+    async get(key) {
+        await this.load();
+        if (!this.index.has(key)) {
+            this.misses++;
+            return undefined;
+        }
+        const data = await this.store.get(key);
+        if (data === undefined) { // Removed behind our back
+            this.totalBytes -= this.index.get(key);
+            this.index.delete(key);
+            this.misses++;
+            return undefined;
+        }
+        const size = this.index.get(key);
+        this.index.delete(key);
+        this.index.set(key, size); // Most recently used
+        this.hits++;
+        return JSON.parse(data.toString('utf8'));
+    }
+
+    async set(key, result) {
+        await this.load();
+        const data = Buffer.from(JSON.stringify(result), 'utf8');
+        if (data.length > this.maxBytes) return; // Would evict everything and still not fit
+
+        if (this.index.has(key)) {
+            this.totalBytes -= this.index.get(key);
+            this.index.delete(key);
+        }
+        await this.store.set(key, data);
+        this.index.set(key, data.length);
+        this.totalBytes += data.length;
+        await this.evict();
+    }
+
+    async evict() {
+        for (const [key, size] of this.index) {
+            if (this.totalBytes <= this.maxBytes) break;
+            this.index.delete(key);
+            this.totalBytes -= size;
+            await this.store.delete(key);
+        }
+    }
+
+    stats() {
+        return { entries: this.index.size, bytes: this.totalBytes, hits: this.hits, misses: this.misses };
+    }
+}
+
+module.exports = {
+    ResultCache,
+    MemoryStore,
+    FileStore,
+    DEFAULT_CACHE_MAX_BYTES
+};
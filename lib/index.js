@@ -1,62 +1,305 @@
 // lib/index.js - WITH DEBUG SUPPORT
 
 const fs = require('fs');
+const os = require('os');
 const path = require('path');
-const { performance } = require('perf_hooks');
+const v8 = require('v8');
 const chalk = require('chalk'); // Keep chalk for potential logging
+const { ResultCache, MemoryStore, FileStore } = require('./cache');
+const { executeRecords: runRecords } = require('./records');
+const { executeNative: runNative, nativeAvailable } = require('./native');
+const { Scheduler } = require('./scheduler');
+const { QuotaManager } = require('./quota');
 
 const wasmModuleGluePath = path.resolve(__dirname, 'vm', 'bf_vm.js');
+const wasmBinaryPath = path.resolve(__dirname, 'vm', 'bf_vm.wasm');
+// memory64 build (npm run build:wasm64), used for runs that don't fit wasm32
+const wasm64ModuleGluePath = path.resolve(__dirname, 'vm', 'bf_vm64.js');
+const wasm64BinaryPath = path.resolve(__dirname, 'vm', 'bf_vm64.wasm');
+// -pthread build (npm run build:wasm-threads), used by executeBatch
+const wasmThreadsModuleGluePath = path.resolve(__dirname, 'vm', 'bf_vm_mt.js');
+const wasmThreadsBinaryPath = path.resolve(__dirname, 'vm', 'bf_vm_mt.wasm');
+
+// Builds createInstance can load
+const BUILD_WASM32 = { glue: wasmModuleGluePath, binary: wasmBinaryPath, wide: false, script: 'build' };
+const BUILD_WASM64 = { glue: wasm64ModuleGluePath, binary: wasm64BinaryPath, wide: true, script: 'build:wasm64' };
+const BUILD_THREADS = { glue: wasmThreadsModuleGluePath, binary: wasmThreadsBinaryPath, wide: false, script: 'build:wasm-threads' };
 
 // Default VM options
 const DEFAULT_MEMORY_SIZE = 90000; // Your updated default
 const DEFAULT_MAX_OUTPUT_SIZE = 65536;
+const DEFAULT_ENGINE = 'trace';
+
+// Engine names -> bfvm_run engine_flags (BFVM_ENGINE_* in bf_vm.c)
+const ENGINE_FLAGS = {
+    interpreter: 0x0, // Plain interpreter with closed-form loops
+    trace: 0x1,       // + trace tier for hot loops
+    'trace-cached': 0x3, // + balanced traces keep their cells in a register
+};
+const ENGINE_HANG_DETECT = 0x4; // BFVM_ENGINE_HANG_DETECT, see options.detectHangs
+const ENGINE_LOCKSTEP = 0x8;    // BFVM_ENGINE_LOCKSTEP, see executeBatch's options.lockstep
+
+// Runs with a larger tape get a disposable instance (see options.isolate)
+const DEFAULT_ISOLATE_THRESHOLD = 64 * 1024 * 1024;
+// Runs whose tape + output exceed this go to a disposable memory64 instance
+// (the wasm32 build's heap is capped at 4 GB, and holds code, input and tables too)
+const WASM32_MAX_RUN_BYTES = 3 * 1024 * 1024 * 1024;
+
+// executeBatch threads (calling thread included); the threads build's
+// PTHREAD_POOL_SIZE must be at least MAX_BATCH_THREADS - 1
+const MAX_BATCH_THREADS = 8;
+// BfvmBatchJob in the wasm32 heap: input*, in_len, out*, out_max, BfvmResult (8-aligned)
+const BATCH_JOB_SIZE = 56;
+const BATCH_RESULT_OFFSET = 16;
+const BATCH_ERROR_OFFSET = BATCH_RESULT_OFFSET + 24;
 
 // --- Wasm Module State ---
-let wasmModule = null;
-let wasmRun = null;
-let wasmAlloc = null;
-let wasmFree = null;
+let shared = null; // Long-lived instance (see bindInstance), created by initializeEngine()
+let threadsPromise = null; // Memoized threads build instance (null if it isn't built)
+
+// Persistent Wasm heap region reused by executeSync for code/input/output
+let scratchPtr = 0;
+let scratchSize = 0;
+const MIN_SCRATCH_SIZE = 128 * 1024;
+const textEncoder = new TextEncoder();
 let isInitialized = false;
-let isInitializing = false;
+let initPromise = null;         // Memoized initializeEngine()
+const wasmCompilePromises = new Map(); // Binary path -> memoized WebAssembly.compile
+const compiledPrograms = new Map(); // Prewarmed source -> BrainfuckProgram* in the Wasm heap
 
-// --- Wasm Module Initialization ---
-const initializeEngine = async () => {
-    // ... (Initialization logic remains mostly the same) ...
-     if (isInitialized || isInitializing) return;
-    isInitializing = true;
+// --- Startup Snapshot Support ---
+// Loaded by a snapshot builder (lib/snapshot.js): keep the Wasm bytes in the
+// heap so the snapshotted process doesn't read them from disk, and start the
+// initialization as soon as the snapshot is deserialized. (WebAssembly isn't
+// available while the snapshot is built, so the instance can't be in it.)
+let wasmBinary = null;
+if (v8.startupSnapshot?.isBuildingSnapshot()) {
+    wasmBinary = fs.readFileSync(wasmBinaryPath);
+    require(wasmModuleGluePath); // Evaluate the glue now, not at startup
+    v8.startupSnapshot.addDeserializeCallback(() => {
+        initializeEngine().catch(() => {}); // Errors surface again on first use
+    });
+}
 
-    if (!fs.existsSync(wasmModuleGluePath)) {
-        isInitializing = false;
-        throw new Error(`Wasm glue code not found at ${wasmModuleGluePath}. Did you run 'npm run build'?`);
+// --- Wasm Module Initialization ---
+// The binary is compiled asynchronously (off the main thread) and handed to
+// the Emscripten glue through instantiateWasm. Both the compile and the whole
+// initialization are memoized promises, so concurrent callers share them.
+const compileWasm = (binaryPath = wasmBinaryPath) => {
+    let promise = wasmCompilePromises.get(binaryPath);
+    if (!promise) {
+        const bytes = wasmBinary && binaryPath === wasmBinaryPath
+            ? Promise.resolve(wasmBinary) : fs.promises.readFile(binaryPath);
+        promise = bytes.then(binary => WebAssembly.compile(binary));
+        promise.catch(() => wasmCompilePromises.delete(binaryPath)); // Retry on next call
+        wasmCompilePromises.set(binaryPath, promise);
     }
-    const createBfvmModule = require(wasmModuleGluePath);
+    return promise;
+};
 
-    try {
-        wasmModule = await createBfvmModule({
-            // Increase initial memory if needed, ALLOW_MEMORY_GROWTH handles expansion
-            // initialMemory: 256 * 65536 // Example: 16MB initial heap
-        });
+// Wraps a C function. `sig` has one letter per argument: 'p' for pointers and
+// size_t, 'i' for int. memory64 builds take 'p' arguments as BigInt, and a
+// 'p' result comes back as one.
+const wrapExport = (module, wide, name, result, sig) => {
+    const fn = module.cwrap(name, result ? 'number' : null, Array.from(sig, () => 'number'));
+    if (!wide) return fn;
+    return (...args) => {
+        const ret = fn(...args.map((arg, i) => (sig[i] === 'p' ? BigInt(arg) : arg)));
+        return result === 'p' ? Number(ret) : ret;
+    };
+};
 
-        // Wrap the C functions - UPDATE SIGNATURE FOR bfvm_run
-        wasmRun = wasmModule.cwrap(
-            'bfvm_run', 'number',
-            // code*, code_len, input*, in_len, out*, out_max, mem_size, debug_callback_ptr, single_step
-            ['number', 'number', 'number', 'number', 'number', 'number', 'number', 'number', 'number']
-        );
-        wasmAlloc = wasmModule.cwrap('bfvm_mem_alloc', 'number', ['number']);
-        wasmFree = wasmModule.cwrap('bfvm_mem_free', null, ['number']);
+// Wraps the C functions of one module instance
+const bindInstance = (module, wide) => {
+    const instance = {
+        module,
+        wide,
+        // code*, code_len, input*, in_len, out*, out_max, mem_size, debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr
+        run: wrapExport(module, wide, 'bfvm_run', 'i', 'ppppppppiip'),
+        // program*, input*, in_len, out*, out_max, mem_size, debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr
+        runProgram: wrapExport(module, wide, 'bfvm_run_program', 'i', 'pppppppiip'),
+        compileProgram: wrapExport(module, wide, 'bfvm_compile', 'p', 'ppp'),
+        freeProgram: wrapExport(module, wide, 'bfvm_program_free', null, 'p'),
+        // program*, jobs*, job_count, mem_size, engine_flags, threads, cancel_poll_ptr
+        batchRun: wrapExport(module, wide, 'bfvm_batch_run', 'i', 'ppppiip'),
+        // program*, config*, error_out* / instance*, max_ops, result* (see lib/scheduler.js)
+        createInstance: wrapExport(module, wide, 'bfvm_instance_create', 'p', 'ppp'),
+        sliceInstance: wrapExport(module, wide, 'bfvm_instance_slice', 'i', 'ppp'),
+        freeInstance: wrapExport(module, wide, 'bfvm_instance_free', null, 'p'),
+        alloc: wrapExport(module, wide, 'bfvm_mem_alloc', 'p', 'p'),
+        free: wrapExport(module, wide, 'bfvm_mem_free', null, 'p'),
+        cancelFlag: wrapExport(module, wide, 'bfvm_cancel_flag', 'p', '')
+    };
+    // The *_ex entry points fill a BfvmResult (64-bit output_len at offset 0, ops at 32)
+    const runEx = wrapExport(module, wide, 'bfvm_run_ex', 'i', 'ppppppppiipp');
+    const runProgramEx = wrapExport(module, wide, 'bfvm_run_program_ex', 'i', 'pppppppiipp');
+    // program*, tape*, start_ip, start_dp, then as bfvm_run_program_ex
+    const runProgramTape = wrapExport(module, wide, 'bfvm_run_program_tape', 'i', 'ppppppppppiipp');
+    // program*, tape*, start_ip, start_dp, watchpoints*, watch_count, hit*, then as bfvm_run_program_ex
+    const runProgramWatch = wrapExport(module, wide, 'bfvm_run_program_watch', 'i', 'pppppppppppppiipp');
+    const resultPtr = instance.alloc(40); // sizeof(BfvmResult)
+    if (!resultPtr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+    instance.runEx = (...args) => runEx(...args, resultPtr);
+    instance.runProgramEx = (...args) => runProgramEx(...args, resultPtr);
+    instance.runProgramTape = (...args) => runProgramTape(...args, resultPtr);
+    instance.runProgramWatch = (...args) => runProgramWatch(...args, resultPtr);
+    instance.lastResult = () => {
+        const view = new DataView(module.HEAPU8.buffer);
+        return { outputLength: Number(view.getBigUint64(resultPtr, true)), ops: Number(view.getBigUint64(resultPtr + 32, true)) };
+    };
+    if (wide) {
+        // Outputs past 2 GB don't fit bfvm_run's int result
+        instance.run = (...args) => {
+            const resultCode = instance.runEx(...args);
+            return resultCode < 0 ? resultCode : instance.lastResult().outputLength;
+        };
+    }
+    return instance;
+};
 
+// Instantiates the (memoized) compiled module of `build` (BUILD_*) with its own Memory
+const createInstance = async (build = BUILD_WASM32) => {
+    if (!fs.existsSync(build.glue)) {
+        throw new Error(`Wasm glue code not found at ${build.glue}. It isn't checked in: run 'npm run ${build.script}' (needs Emscripten).`);
+    }
+    const createBfvmModule = require(build.glue);
+    const compiled = await compileWasm(build.binary);
+    const module = await new Promise((resolve, reject) => {
+        createBfvmModule({
+            instantiateWasm(imports, receiveInstance) {
+                WebAssembly.instantiate(compiled, imports)
+                    .then(instance => receiveInstance(instance, compiled), reject);
+                return {}; // Exports arrive through receiveInstance
+            }
+        }).then(resolve, reject);
+    });
+    return bindInstance(module, build.wide);
+};
+
+const loadEngine = async () => {
+    try {
+        shared = await createInstance();
         isInitialized = true;
-        isInitializing = false;
 
     } catch (err) {
         console.error(chalk.red("Error initializing Brainfuck Wasm engine:"), err);
         isInitialized = false;
-        isInitializing = false;
         throw err;
     }
 };
 
+const initializeEngine = () => {
+    if (!initPromise) {
+        initPromise = loadEngine().catch(err => {
+            initPromise = null; // Let a later call try again
+            throw err;
+        });
+    }
+    return initPromise;
+};
+
+/**
+ * Gets the engine ready ahead of first traffic: compiles and instantiates the
+ * Wasm module, and pre-scans the given programs (jump table and loop analysis)
+ * so later execute()/executeSync() calls with the same code skip that work.
+ * @param {object} [options={}]
+ * @param {string[]} [options.programs=[]] Brainfuck sources to compile.
+ * @returns {Promise<void>}
+ * @throws {Error} If initialization fails or a program doesn't compile (e.g. unmatched brackets).
+ */
+async function prewarm(options = {}) {
+    await initializeEngine();
+    for (const code of options.programs ?? []) {
+        if (compiledPrograms.has(code)) continue;
+        const codeBytes = Buffer.from(code, 'utf8');
+        const codePtr = shared.alloc(codeBytes.length || 1);
+        const errorPtr = shared.alloc(4);
+        let programPtr = 0, errorCode = -10;
+        try {
+            if (!codePtr || !errorPtr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+            shared.module.HEAPU8.set(codeBytes, codePtr);
+            programPtr = shared.compileProgram(codePtr, codeBytes.length, errorPtr);
+            errorCode = shared.module.HEAP32[errorPtr >> 2];
+        } finally {
+            if (codePtr) shared.free(codePtr);
+            if (errorPtr) shared.free(errorPtr);
+        }
+        if (!programPtr) {
+            throw new Error(`Brainfuck VM Error: ${getErrorMessage(errorCode)} (Code: ${errorCode})`);
+        }
+        compiledPrograms.set(code, programPtr);
+    }
+}
+
+// --- Returned Tapes ---
+// Tapes returned as views stay allocated until the view is collected
+const tapeViews = new FinalizationRegistry(({ vm, ptr }) => vm.free(ptr));
+
+// The final tape of a run as { tape, tapeOffset }: a copy, or a view that
+// takes over the tape allocation. 'touched' trims it to the cells from the
+// first to the last non-zero one.
+const takeTape = (vm, tapePtr, memorySize, mode, range) => {
+    const heap = vm.module.HEAPU8;
+    let start = 0, end = memorySize;
+    if (range === 'touched') {
+        while (end > 0 && heap[tapePtr + end - 1] === 0) end--;
+        while (start < end && heap[tapePtr + start] === 0) start++;
+    }
+    if (mode === 'copy') return { tape: Buffer.from(heap.subarray(tapePtr + start, tapePtr + end)), tapeOffset: start };
+    const tape = new Uint8Array(heap.buffer, tapePtr + start, end - start);
+    tapeViews.register(tape, { vm, ptr: tapePtr });
+    return { tape, tapeOffset: start };
+};
+
+// --- Watchpoints ---
+// Fixed layouts (bfvm.h): BfvmWatchpoint { first, count, kinds, reserved } and
+// BfvmWatchHit { ip, cell, watchpoint, kind, old_value, new_value }
+const WATCHPOINT_SIZE = 24;
+const WATCH_HIT_SIZE = 32;
+const WATCH_KINDS = { read: 0x1, write: 0x2, change: 0x4 };
+
+// Checks options.watchpoints and returns them as { first, count, kinds }
+const parseWatchpoints = (watchpoints, memorySize) => {
+    if (!Array.isArray(watchpoints)) throw new Error("Invalid option: watchpoints must be an array.");
+    return watchpoints.map(({ start, length = 1, on = 'change' }) => {
+        if (!Number.isInteger(start) || !Number.isInteger(length) || start < 0 || length < 1 || start + length > memorySize) {
+            throw new Error("Invalid option: a watchpoint's cells (start, length) must be on the tape.");
+        }
+        let kinds = 0;
+        for (const kind of [].concat(on)) {
+            if (!(kind in WATCH_KINDS)) throw new Error("Invalid option: a watchpoint's on must be 'read', 'write' or 'change'.");
+            kinds |= WATCH_KINDS[kind];
+        }
+        return { first: start, count: length, kinds };
+    });
+};
+
+const writeWatchpoints = (vm, ptr, watchpoints) => {
+    const view = new DataView(vm.module.HEAPU8.buffer);
+    watchpoints.forEach(({ first, count, kinds }, i) => {
+        view.setBigUint64(ptr + i * WATCHPOINT_SIZE, BigInt(first), true);
+        view.setBigUint64(ptr + i * WATCHPOINT_SIZE + 8, BigInt(count), true);
+        view.setInt32(ptr + i * WATCHPOINT_SIZE + 16, kinds, true);
+        view.setInt32(ptr + i * WATCHPOINT_SIZE + 20, 0, true);
+    });
+};
+
+const readWatchHit = (vm, ptr) => {
+    const view = new DataView(vm.module.HEAPU8.buffer);
+    const kind = view.getInt32(ptr + 20, true);
+    return {
+        instructionPointer: Number(view.getBigUint64(ptr, true)),
+        cell: Number(view.getBigUint64(ptr + 8, true)),
+        watchpoint: view.getInt32(ptr + 16, true),
+        kind: Object.keys(WATCH_KINDS).find(name => WATCH_KINDS[name] === kind),
+        oldValue: view.getUint8(ptr + 24),
+        newValue: view.getUint8(ptr + 25)
+    };
+};
+
+// A run cancelled by options.timeoutMs
+const timeoutError = (timeoutMs) => new Error(`Brainfuck VM Error: Execution Timed Out after ${timeoutMs} ms. (Code: -13)`);
+
 // --- Error Mapping (Add new codes) ---
 const getErrorMessage = (errorCode) => {
     switch (errorCode) {
@@ -71,6 +314,11 @@ const getErrorMessage = (errorCode) => {
         case -9: return "Execution Halted by Debugger."; // New
         case -10: return "Internal Error: Invalid arguments passed to bfvm_run.";
         case -11: return "Internal Error: Failed to allocate breakpoint buffer."; // Add if implementing breakpoints
+        case -12: return "Runtime Error: Infinite loop detected (loop state repeated).";
+        case -13: return "Execution Cancelled.";
+        case -14: return "Internal Error: Output length exceeds the 32-bit result.";
+        case -15: return "Output Error: The host write callback failed.";
+        case -16: return "Watchpoint Hit: Execution stopped at a watched cell.";
         default: return `Unknown error code: ${errorCode}`;
     }
 };
@@ -79,18 +327,31 @@ const getErrorMessage = (errorCode) => {
 // --- Internal Debug Callback Handler ---
 // This is the function that C will call directly.
 // It needs to be registered with Emscripten.
-// It then calls the user-provided async callback.
-async function internalDebugCallback(ip, dp, currentCellValue, userCallback) {
+// The VM waits for its int result, so the user callback runs synchronously and
+// `tape` is a live view of the Wasm heap, valid only during the call. An async
+// callback settles after the VM has moved on: it gets a copy of the tape, and
+// its result can't halt the run.
+const warnedAsyncCallbacks = new WeakSet();
+
+function internalDebugCallback(ip, dp, currentCellValue, tape, userCallback) {
     // console.log(`DEBUG: IP=${ip}, DP=${dp}, Mem[DP]=${currentCellValue}`); // Basic logging
     if (userCallback && typeof userCallback === 'function') {
         try {
-            // Allow user callback to be async and signal halt/continue
-            const shouldHalt = await userCallback({
+            const isAsync = userCallback.constructor.name === 'AsyncFunction';
+            const shouldHalt = userCallback({
                 instructionPointer: ip,
                 dataPointer: dp,
                 currentCellValue: currentCellValue,
-                // TODO: Add ways to inspect memory or step control if needed
+                tape: isAsync ? tape.slice() : tape // Live view (no copy) for synchronous callbacks
             });
+            if (shouldHalt && typeof shouldHalt.then === 'function') {
+                if (!warnedAsyncCallbacks.has(userCallback)) {
+                    warnedAsyncCallbacks.add(userCallback);
+                    console.warn(chalk.yellow("Warning: onDebugStep returned a Promise; only a synchronous `true` halts the run."));
+                }
+                shouldHalt.catch(e => console.error(chalk.red("Error in user debug callback:"), e));
+                return 0;
+            }
             return shouldHalt ? 1 : 0; // Return 1 to halt, 0 to continue
         } catch (e) {
             console.error(chalk.red("Error in user debug callback:"), e);
@@ -101,6 +362,33 @@ async function internalDebugCallback(ip, dp, currentCellValue, userCallback) {
 }
 
 
+// Makes the scratch region at least `size` bytes. Grows geometrically so a
+// steady stream of similar calls stops allocating after the first one.
+const ensureScratch = (size) => {
+    if (size <= scratchSize) return scratchPtr;
+    const newSize = Math.max(size, scratchSize * 2, MIN_SCRATCH_SIZE);
+    const ptr = shared.alloc(newSize);
+    if (!ptr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+    if (scratchPtr) shared.free(scratchPtr);
+    scratchPtr = ptr;
+    scratchSize = newSize;
+    return ptr;
+};
+
+// Encodes code (unless prewarmed) and input straight into the scratch region.
+// Layout: [output | code | input]; UTF-8 needs at most 3 bytes per UTF-16 unit.
+const writeScratch = (code, input, maxOutputSize, programPtr) => {
+    const base = ensureScratch(maxOutputSize + 3 * ((programPtr ? 0 : code.length) + input.length) + 1);
+    const heap = shared.module.HEAPU8;
+    const end = base + scratchSize;
+    const codePtr = base + maxOutputSize;
+    const codeLen = programPtr ? 0 : textEncoder.encodeInto(code, heap.subarray(codePtr, end)).written;
+    const inputPtr = codePtr + codeLen;
+    const inputLen = textEncoder.encodeInto(input, heap.subarray(inputPtr, end)).written;
+    return { outputPtr: base, codePtr, codeLen, inputPtr, inputLen };
+};
+
+
 // --- Main Execution Function (Updated for Debugging) ---
 /**
  * Executes Brainfuck code using the Wasm VM.
@@ -110,18 +398,56 @@ async function internalDebugCallback(ip, dp, currentCellValue, userCallback) {
  * @param {number} [options.memorySize=DEFAULT_MEMORY_SIZE] BF tape size.
  * @param {number} [options.maxOutputSize=DEFAULT_MAX_OUTPUT_SIZE] Max output buffer size.
  * @param {boolean} [options.singleStep=false] Enable step-by-step debugging hook.
- * @param {function} [options.onDebugStep] Async callback function called on each step if singleStep is true.
- *                                         Receives { instructionPointer, dataPointer, currentCellValue }.
+ * @param {function} [options.onDebugStep] Callback called on each step if singleStep is true (synchronously: the VM
+ *                                         waits for it). Receives { instructionPointer, dataPointer, currentCellValue, tape };
+ *                                         `tape` is a live view valid only during the call (a copy for async functions).
  *                                         Should return `true` to halt execution, `false` or nothing to continue.
- * @returns {Promise<{ output: string, duration: number, memoryStats: { wasmHeapBefore: number, wasmHeapAfter: number } }>} Execution results.
- * @throws {Error} If initialization, execution, or debugging encounters an error.
+ * @param {ResultCache} [options.cache] Opt-in result cache; a hit returns the stored result without running.
+ *                                      Not consulted while single stepping.
+ * @param {string} [options.engine=DEFAULT_ENGINE] 'trace' (hot loops run as recorded traces), 'trace-cached'
+ *                                                (balanced traces also keep their cells in a register) or
+ *                                                'interpreter'.
+ *                                                Ignored (interpreter) while single stepping.
+ * @param {boolean} [options.detectHangs=false] Fail with an error as soon as a loop provably never terminates
+ *                                              (its state repeats). Runs on the interpreter, so slower than
+ *                                              the trace engines; meant for untrusted or test-generated code.
+ * @param {AbortSignal} [options.signal] Cancels the run with a "Execution Cancelled." error. The VM polls for it at
+ *                                      loop back-edges, so it takes effect mid-run when aborted from code that runs
+ *                                      during execution (e.g. onDebugStep); an already-aborted signal rejects at once.
+ * @param {Int32Array} [options.cancelFlag] View on a SharedArrayBuffer; a non-zero element 0 cancels the run.
+ *                                          Lets another thread stop a run in progress (the calling thread is busy).
+ * @param {number} [options.timeoutMs] Cancels the run once it has run this long, with an "Execution Timed Out"
+ *                                     error (code -13). Checked at the same polls as cancelFlag.
+ * @param {boolean} [options.isolate] Run in a disposable Wasm instance with its own Memory, dropped afterwards,
+ *                                    so a large tape doesn't permanently grow the shared instance's heap.
+ *                                    Defaults to true when memorySize exceeds DEFAULT_ISOLATE_THRESHOLD.
+ *                                    Runs too large for wasm32 always use a disposable memory64 instance.
+ * @param {QuotaManager} [options.quota] Admits the run for options.tenant first (rejecting or throttling a tenant
+ *                                       over quota) and charges what it used afterwards. The output limit is capped
+ *                                       by the tenant's remaining output bytes, and the run is cancelled when it
+ *                                       outlasts the remaining run time. Cache hits are free.
+ * @param {string} [options.tenant='default'] Quota key.
+ * @param {string} [options.returnTape] 'view' or 'copy': also return the final tape (VM errors carry it too, as
+ *                                      error.tape). A view is a Uint8Array on the Wasm heap that keeps the tape
+ *                                      allocated until it is garbage collected; it is detached if the heap grows.
+ * @param {string} [options.tapeRange='full'] 'touched' returns only the cells from the first to the last
+ *                                            non-zero one (tapeOffset is the first one's index).
+ * @param {Uint8Array} [options.initialTape] Cells copied onto the tape before the run, e.g. a data block the
+ *                                           program would otherwise read in with ',' loops.
+ * @param {number} [options.initialTapeOffset=0] Cell index initialTape is copied to.
+ * @param {number} [options.startIp=0] Code byte to start at (e.g. past the prologue initialTape replaces).
+ * @param {number} [options.startDp=0] Cell the data pointer starts at.
+ * @param {Array<{ start: number, length?: number, on?: string | string[] }>} [options.watchpoints] Cell ranges
+ *        watched for 'read', 'write' or 'change' (the default). The run stops after the first matching access and
+ *        resolves with the output so far and `watchpointHit`. Runs on the interpreter, checking a bitmap per access.
+ * @returns {Promise<{ output: string, duration: number, memoryStats: { wasmHeapBefore: number, wasmHeapAfter: number }, cached?: boolean, ops?: number, tape?: Uint8Array, tapeOffset?: number, watchpointHit?: object }>}
+ *          Execution results; `ops` (loop back-edges run) with a quota, `tape` with returnTape, and
+ *          `watchpointHit` ({ instructionPointer, cell, watchpoint, kind, oldValue, newValue }) if a watchpoint stopped the run.
+ * @throws {Error} If initialization, execution, or debugging encounters an error, or the tenant is over quota.
  */
 async function execute(code, input = '', options = {}) {
-    if (!isInitialized) {
-         while (isInitializing) { await new Promise(resolve => setTimeout(resolve, 5)); }
-        if (!isInitialized) { await initializeEngine(); }
-    }
-    if (!wasmModule || !wasmRun || !wasmAlloc || !wasmFree) {
+    if (!isInitialized) await initializeEngine();
+    if (!shared) {
         throw new Error("Brainfuck Wasm engine is not initialized properly.");
     }
 
@@ -129,65 +455,231 @@ async function execute(code, input = '', options = {}) {
     const maxOutputSize = options.maxOutputSize ?? DEFAULT_MAX_OUTPUT_SIZE;
     const singleStep = options.singleStep ?? false;
     const userDebugCallback = options.onDebugStep; // User's async function
+    const engine = options.engine ?? DEFAULT_ENGINE;
+    const detectHangs = options.detectHangs ?? false;
+    const signal = options.signal;
+    const cancelFlag = options.cancelFlag;
+    const quota = options.quota;
+    const tenant = options.tenant ?? 'default';
+    const timeoutMs = options.timeoutMs;
+    const returnTape = options.returnTape;
+    const tapeRange = options.tapeRange ?? 'full';
+    const initialTape = options.initialTape;
+    const initialTapeOffset = options.initialTapeOffset ?? 0;
+    const startIp = options.startIp ?? 0;
+    const startDp = options.startDp ?? 0;
+    const preloaded = initialTape !== undefined || startIp !== 0 || startDp !== 0;
+    const watchpoints = options.watchpoints === undefined ? null : parseWatchpoints(options.watchpoints, memorySize);
+    const wide = memorySize + maxOutputSize > WASM32_MAX_RUN_BYTES;
+    const isolate = wide || (options.isolate ?? memorySize > DEFAULT_ISOLATE_THRESHOLD);
 
     if (memorySize <= 0) throw new Error("Invalid option: memorySize must be positive.");
     if (maxOutputSize <= 0) throw new Error("Invalid option: maxOutputSize must be positive.");
+    if (!(engine in ENGINE_FLAGS)) {
+        throw new Error(`Invalid option: engine must be one of ${Object.keys(ENGINE_FLAGS).join(', ')}.`);
+    }
+    if (cancelFlag !== undefined && !(cancelFlag instanceof Int32Array && cancelFlag.buffer instanceof SharedArrayBuffer)) {
+        throw new Error("Invalid option: cancelFlag must be an Int32Array on a SharedArrayBuffer.");
+    }
+    if (timeoutMs !== undefined && !(timeoutMs >= 0)) throw new Error("Invalid option: timeoutMs must be a non-negative number.");
+    if (returnTape !== undefined && returnTape !== 'view' && returnTape !== 'copy') {
+        throw new Error("Invalid option: returnTape must be 'view' or 'copy'.");
+    }
+    if (tapeRange !== 'full' && tapeRange !== 'touched') {
+        throw new Error("Invalid option: tapeRange must be 'full' or 'touched'.");
+    }
+    if (initialTape !== undefined && !(initialTape instanceof Uint8Array)) {
+        throw new Error("Invalid option: initialTape must be a Buffer or Uint8Array.");
+    }
+    if (!Number.isInteger(initialTapeOffset) || initialTapeOffset < 0
+        || initialTapeOffset + (initialTape?.length ?? 0) > memorySize) {
+        throw new Error("Invalid option: initialTape must fit the tape at initialTapeOffset.");
+    }
+    if (!Number.isInteger(startIp) || startIp < 0) throw new Error("Invalid option: startIp must be a non-negative integer.");
+    if (!Number.isInteger(startDp) || startDp < 0 || startDp >= memorySize) {
+        throw new Error("Invalid option: startDp must be a cell of the tape.");
+    }
+    if (signal?.aborted || (cancelFlag && Atomics.load(cancelFlag, 0) !== 0)) {
+        throw new Error(`Brainfuck VM Error: ${getErrorMessage(-13)} (Code: -13)`);
+    }
+
+    // Runs are deterministic: identical code/input/limits give identical results
+    const cache = singleStep || returnTape || preloaded || watchpoints ? null : options.cache;
+    const cacheKey = cache ? ResultCache.keyFor(code, input, memorySize, maxOutputSize) : null;
+    if (cache) {
+        const hit = await cache.get(cacheKey);
+        if (hit) return { ...hit, cached: true };
+    }
     if (singleStep && typeof userDebugCallback !== 'function') {
         console.warn(chalk.yellow("Warning: singleStep enabled but no onDebugStep callback function provided."));
     }
 
+    // Quota admission (may wait in throttle mode); the run's limits come from what is left
+    const admission = quota ? await quota.admit(tenant, { memorySize, maxOutputSize, signal }) : null;
+    const outputLimit = admission ? admission.maxOutputSize : maxOutputSize;
+    const deadline = admission && admission.cpuMs !== Infinity ? performance.now() + admission.cpuMs : Infinity;
+    const timeoutAt = timeoutMs === undefined ? Infinity : performance.now() + timeoutMs;
+    const stopAt = Math.min(deadline, timeoutAt);
+    let ops = 0, runTime = 0;
+
     let codePtr = 0, inputPtr = 0, outputPtr = 0;
+    let programPtr = 0;
+    let tapePtr = 0, errorPtr = 0, ownsProgram = false; // Runs on a tape allocated here
+    let watchPtr = 0;
+    let tapeResult = null, watchpointHit = null;
+    let ownsBuffers = false; // false: pointers are into the shared scratch region
     let resultCode = -10;
     let memoryBefore = 0, memoryAfter = 0;
     let debugCallbackPtr = 0; // Pointer to the registered internal callback
+    let cancelPollPtr = 0;
+    let onAbort = null;
+    let vm = shared; // Instance the run uses; a disposable one is only referenced from here
 
     const perfMarkStart = `bf-exec-start-${Date.now()}-${Math.random()}`;
     const perfMarkEnd = `bf-exec-end-${Date.now()}-${Math.random()}`;
     const perfMeasureName = `BF Execute: ${code.substring(0, 20)}...`;
 
     try {
+        // The compiled module is shared, so a fresh instance only costs the instantiation
+        if (isolate) vm = await createInstance(wide ? BUILD_WASM64 : BUILD_WASM32);
+        const wasmModule = vm.module;
+
         performance.mark(perfMarkStart);
         memoryBefore = wasmModule.HEAPU8.buffer.byteLength;
 
         // Register the debug callback if needed
         if (singleStep && userDebugCallback) {
-            // Wrap the internalDebugCallback to pass the user's function
-            const boundCallback = (ip, dp, cellVal) => internalDebugCallback(ip, dp, cellVal, userDebugCallback);
-            // Register with Emscripten. Signature: int func(int, int, int) -> 'iiii'
-            // Note: size_t in C corresponds to 'number' (often i32) in wasm default bindings
-             debugCallbackPtr = wasmModule.addFunction(boundCallback, 'iiii');
+            // Wrap the internalDebugCallback to pass the user's function and a view of the tape
+            // (ip and dp are size_t: BigInt in memory64 builds; the heap may have grown since the last step)
+            const boundCallback = (ip, dp, cellVal) => internalDebugCallback(Number(ip), Number(dp), cellVal,
+                new Uint8Array(wasmModule.HEAPU8.buffer, tapePtr, memorySize), userDebugCallback);
+            // Register with Emscripten. Signature: int func(size_t, size_t, int) -> 'iiii' ('ijji' for memory64)
+             debugCallbackPtr = Number(wasmModule.addFunction(boundCallback, vm.wide ? 'ijji' : 'iiii'));
         }
 
-        // 1. Encode & Allocate Wasm heap buffers
-        const codeBytes = Buffer.from(code, 'utf8');
-        const inputBytes = Buffer.from(input, 'utf8');
-        codePtr = wasmAlloc(codeBytes.length);
-        inputPtr = wasmAlloc(inputBytes.length > 0 ? inputBytes.length : 1);
-        outputPtr = wasmAlloc(maxOutputSize);
+        // Cancellation: the abort listener raises the flag the VM polls at
+        // back-edges; a SharedArrayBuffer flag is read through a poll hook
+        if (signal) {
+            const flagIndex = vm.cancelFlag() >> 2;
+            wasmModule.HEAP32[flagIndex] = 0;
+            onAbort = () => { wasmModule.HEAP32[flagIndex] = 1; };
+            signal.addEventListener('abort', onAbort, { once: true });
+        }
+        if (cancelFlag || stopAt !== Infinity) {
+            const poll = () => ((cancelFlag && Atomics.load(cancelFlag, 0) !== 0) || performance.now() > stopAt ? 1 : 0);
+            cancelPollPtr = Number(wasmModule.addFunction(poll, 'i'));
+        }
 
-        if (!codePtr || !inputPtr || !outputPtr) {
-            throw new Error("Failed to allocate Wasm heap memory for buffers.");
+        // 1-2. Place code/input/output in the Wasm heap (prewarmed programs are already
+        // there). Regular runs use the persistent scratch region; single-step runs get
+        // their own buffers, because the debug callback may start other runs mid-run.
+        // Prewarmed programs and the scratch region live in the shared instance only.
+        programPtr = isolate ? 0 : compiledPrograms.get(code) ?? 0;
+        let codeLen = 0, inputLen = 0;
+        if (!singleStep && !isolate) {
+            ({ outputPtr, codePtr, codeLen, inputPtr, inputLen } = writeScratch(code, input, outputLimit, programPtr));
+        } else {
+            const codeBytes = programPtr ? null : Buffer.from(code, 'utf8');
+            const inputBytes = Buffer.from(input, 'utf8');
+            ownsBuffers = true;
+            if (!programPtr) codePtr = vm.alloc(codeBytes.length || 1);
+            inputPtr = vm.alloc(inputBytes.length > 0 ? inputBytes.length : 1);
+            outputPtr = vm.alloc(outputLimit);
+
+            if ((!programPtr && !codePtr) || !inputPtr || !outputPtr) {
+                throw new Error("Failed to allocate Wasm heap memory for buffers.");
+            }
+            if (codeBytes) wasmModule.HEAPU8.set(codeBytes, codePtr);
+            if (inputBytes.length > 0) wasmModule.HEAPU8.set(inputBytes, inputPtr);
+            codeLen = programPtr ? 0 : codeBytes.length;
+            inputLen = inputBytes.length;
         }
 
-        // 2. Copy data to Wasm heap
-        wasmModule.HEAPU8.set(codeBytes, codePtr);
-        if (inputBytes.length > 0) wasmModule.HEAPU8.set(inputBytes, inputPtr);
+        // Runs whose tape is looked at (debug events, returnTape, watchpoints) or
+        // preloaded run on one allocated here, which takes a compiled program
+        if (debugCallbackPtr || returnTape || preloaded || watchpoints) {
+            if (!programPtr) {
+                errorPtr = vm.alloc(4);
+                if (!errorPtr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+                programPtr = vm.compileProgram(codePtr, codeLen, errorPtr);
+                if (!programPtr) {
+                    const errorCode = wasmModule.HEAP32[errorPtr >> 2];
+                    throw new Error(`Brainfuck VM Error: ${getErrorMessage(errorCode)} (Code: ${errorCode})`);
+                }
+                ownsProgram = true;
+            }
+            tapePtr = vm.alloc(memorySize);
+            if (!tapePtr) throw new Error("Failed to allocate Wasm heap memory for the tape.");
+            wasmModule.HEAPU8.fill(0, tapePtr, tapePtr + memorySize);
+            if (initialTape) wasmModule.HEAPU8.set(initialTape, tapePtr + initialTapeOffset);
+        }
+        if (watchpoints) {
+            // The watchpoints, then the BfvmWatchHit
+            watchPtr = vm.alloc(watchpoints.length * WATCHPOINT_SIZE + WATCH_HIT_SIZE);
+            if (!watchPtr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+            writeWatchpoints(vm, watchPtr, watchpoints);
+        }
 
         // 3. Execute Wasm function (pass debug ptr and flag)
-        resultCode = wasmRun(
-            codePtr, codeBytes.length,
-            inputPtr, inputBytes.length,
-            outputPtr, maxOutputSize, memorySize,
+        const runArgs = [
+            inputPtr, inputLen,
+            outputPtr, outputLimit, memorySize,
             debugCallbackPtr, // Pass the function pointer (0 if no debug)
-            singleStep ? 1 : 0  // Pass the single step flag
-        );
+            singleStep ? 1 : 0, // Pass the single step flag
+            ENGINE_FLAGS[engine] | (detectHangs ? ENGINE_HANG_DETECT : 0),
+            cancelPollPtr
+        ];
+        const runStart = performance.now();
+        if (tapePtr || quota) {
+            // Through the BfvmResult, for the op count
+            const hitPtr = watchPtr + (watchpoints?.length ?? 0) * WATCHPOINT_SIZE;
+            if (watchPtr) {
+                resultCode = vm.runProgramWatch(programPtr, tapePtr, startIp, startDp,
+                    watchPtr, watchpoints.length, hitPtr, ...runArgs);
+                // A watchpoint stop is a result, with the output up to it
+                if (resultCode === -16) {
+                    watchpointHit = readWatchHit(vm, hitPtr);
+                    resultCode = 0;
+                }
+            } else if (tapePtr) {
+                resultCode = vm.runProgramTape(programPtr, tapePtr, startIp, startDp, ...runArgs);
+            } else {
+                resultCode = programPtr
+                    ? vm.runProgramEx(programPtr, ...runArgs)
+                    : vm.runEx(codePtr, codeLen, ...runArgs);
+            }
+            const last = vm.lastResult();
+            ops = last.ops;
+            if (resultCode >= 0) resultCode = last.outputLength;
+        } else {
+            resultCode = programPtr
+                ? vm.runProgram(programPtr, ...runArgs)
+                : vm.run(codePtr, codeLen, ...runArgs);
+        }
+        runTime = performance.now() - runStart;
 
         memoryAfter = wasmModule.HEAPU8.buffer.byteLength;
         performance.mark(perfMarkEnd);
 
+        if (returnTape) {
+            tapeResult = takeTape(vm, tapePtr, memorySize, returnTape, tapeRange);
+            if (returnTape === 'view') tapePtr = 0; // The view owns it now
+        }
+
         // 4. Handle results/errors from Wasm
+        if (resultCode === -13 && performance.now() > deadline && !signal?.aborted) {
+            throw quota.overQuotaError(tenant, 'cpuMs');
+        }
+        if (resultCode === -13 && performance.now() > timeoutAt && !signal?.aborted) {
+            throw timeoutError(timeoutMs);
+        }
+        if (resultCode === -3 && outputLimit < maxOutputSize) {
+            throw quota.overQuotaError(tenant, 'outputBytes');
+        }
         if (resultCode < 0) {
-            throw new Error(`Brainfuck VM Error: ${getErrorMessage(resultCode)} (Code: ${resultCode})`);
+            const error = new Error(`Brainfuck VM Error: ${getErrorMessage(resultCode)} (Code: ${resultCode})`);
+            if (tapeResult) Object.assign(error, tapeResult); // The state the run stopped in
+            throw error;
         }
 
         // 5. Read output & Measure performance
@@ -202,11 +694,22 @@ async function execute(code, input = '', options = {}) {
         performance.clearMarks(perfMarkEnd);
         performance.clearMeasures(perfMeasureName);
 
-        return {
+        const result = {
             output: outputString,
             duration: duration,
             memoryStats: { wasmHeapBefore: memoryBefore, wasmHeapAfter: memoryAfter }
         };
+        if (quota) result.ops = ops;
+        if (tapeResult) Object.assign(result, tapeResult);
+        if (watchpointHit) result.watchpointHit = watchpointHit;
+        if (cache) {
+            try {
+                await cache.set(cacheKey, result);
+            } catch (cacheErr) {
+                console.warn(chalk.yellow("Warning: could not store result in cache:"), cacheErr.message);
+            }
+        }
+        return result;
 
     } catch (error) {
         performance.clearMarks(perfMarkStart);
@@ -214,11 +717,22 @@ async function execute(code, input = '', options = {}) {
         performance.clearMeasures(perfMeasureName);
         throw error;
     } finally {
+        // Failed runs are charged too (the output only counts when it is returned)
+        if (quota) quota.charge(tenant, { ops, outputBytes: resultCode > 0 ? resultCode : 0, cpuMs: runTime });
+
         // 6. IMPORTANT: Free Wasm *heap* buffers AND the debug callback
-        if (wasmFree) {
-            if (codePtr) wasmFree(codePtr);
-            if (inputPtr) wasmFree(inputPtr);
-            if (outputPtr) wasmFree(outputPtr);
+        // (a disposable instance is dropped whole, Memory included, when vm goes out of scope)
+        const wasmModule = vm.module;
+        if (ownsBuffers && vm === shared) {
+            if (codePtr) vm.free(codePtr);
+            if (inputPtr) vm.free(inputPtr);
+            if (outputPtr) vm.free(outputPtr);
+        }
+        if (vm === shared) {
+            if (tapePtr) vm.free(tapePtr);
+            if (errorPtr) vm.free(errorPtr);
+            if (watchPtr) vm.free(watchPtr);
+            if (ownsProgram) vm.freeProgram(programPtr);
         }
         // Unregister the debug callback function from Emscripten runtime
         if (debugCallbackPtr !== 0 && wasmModule && wasmModule.removeFunction) {
@@ -229,13 +743,298 @@ async function execute(code, input = '', options = {}) {
                  // console.warn("Could not remove debug function pointer:", removeErr);
             }
         }
+        if (cancelPollPtr !== 0 && wasmModule && wasmModule.removeFunction) {
+            try {
+                wasmModule.removeFunction(cancelPollPtr);
+            } catch (removeErr) {
+                // As above: must not hide the run's own error
+            }
+        }
+        if (onAbort) {
+            signal.removeEventListener('abort', onAbort);
+            wasmModule.HEAP32[vm.cancelFlag() >> 2] = 0;
+        }
+    }
+}
+
+/**
+ * Synchronous fast path of execute() for an already initialized engine.
+ * Code, input and output share a persistent scratch region in the Wasm heap
+ * (strings are encoded straight into it), and no performance marks are made,
+ * so small programs cost little more than the VM run itself.
+ * Not supported here: single stepping, result caching and AbortSignal.
+ * @param {string} code The Brainfuck code to execute.
+ * @param {string} [input=''] Optional input string.
+ * @param {object} [options={}] memorySize, maxOutputSize, engine, detectHangs (as for execute()).
+ * @returns {{ output: string, duration: number }} Execution results.
+ * @throws {Error} If the engine isn't initialized or the VM reports an error.
+ */
+function executeSync(code, input = '', options = {}) {
+    if (!isInitialized) {
+        throw new Error("Brainfuck Wasm engine is not initialized; await initializeEngine() before executeSync().");
+    }
+
+    const memorySize = options.memorySize ?? DEFAULT_MEMORY_SIZE;
+    const maxOutputSize = options.maxOutputSize ?? DEFAULT_MAX_OUTPUT_SIZE;
+    const engine = options.engine ?? DEFAULT_ENGINE;
+    const engineFlags = ENGINE_FLAGS[engine];
+
+    if (memorySize <= 0) throw new Error("Invalid option: memorySize must be positive.");
+    if (maxOutputSize <= 0) throw new Error("Invalid option: maxOutputSize must be positive.");
+    if (engineFlags === undefined) {
+        throw new Error(`Invalid option: engine must be one of ${Object.keys(ENGINE_FLAGS).join(', ')}.`);
+    }
+
+    // Prewarmed programs skip the code part (and the pre-scan)
+    const programPtr = compiledPrograms.get(code) ?? 0;
+    const { outputPtr: base, codePtr, codeLen, inputPtr, inputLen } = writeScratch(code, input, maxOutputSize, programPtr);
+    const flags = engineFlags | (options.detectHangs ? ENGINE_HANG_DETECT : 0);
+
+    const startTime = performance.now();
+    const resultCode = programPtr
+        ? shared.runProgram(programPtr, inputPtr, inputLen, base, maxOutputSize, memorySize, 0, 0, flags, 0)
+        : shared.run(codePtr, codeLen, inputPtr, inputLen, base, maxOutputSize, memorySize, 0, 0, flags, 0);
+    const duration = performance.now() - startTime;
+
+    if (resultCode < 0) {
+        throw new Error(`Brainfuck VM Error: ${getErrorMessage(resultCode)} (Code: ${resultCode})`);
+    }
+    // The VM may have grown the heap: read through the current buffer
+    const output = Buffer.from(shared.module.HEAPU8.buffer, base, resultCode).toString('utf8');
+    return { output, duration };
+}
+
+/**
+ * Runs a stateless per-record program once per input record (e.g. per line),
+ * optionally spread over worker threads, and concatenates outputs in order.
+ * See lib/records.js for the options.
+ */
+function executeRecords(code, input = '', options = {}) {
+    return runRecords(execute, code, input, options);
+}
+
+// Loads the threads build once; resolves to null when it isn't built
+const loadThreads = () => {
+    if (!threadsPromise) {
+        threadsPromise = fs.existsSync(wasmThreadsModuleGluePath) ? createInstance(BUILD_THREADS) : Promise.resolve(null);
+        threadsPromise.catch(() => { threadsPromise = null; }); // Retry on next call
     }
+    return threadsPromise;
+};
+
+// Runs the batch inside the threads build: the program is compiled once into
+// the shared Wasm memory and bfvm_batch_run spreads the inputs over threads.
+// The calling thread blocks (and works) until every input is done. It is the
+// one that calls the poll hook (cancelFlag, timeout), and a cancel raises the
+// module's cancel flag, which stops the other threads.
+const runBatchThreaded = (vm, code, inputs, memorySize, maxOutputSize, engineFlags, threads, cancel) => {
+    const { signal, cancelFlag, timeoutAt, timeoutMs } = cancel;
+    const codeBytes = Buffer.from(code, 'utf8');
+    const inputBytes = inputs.map(input => Buffer.from(input, 'utf8'));
+    const inputTotal = inputBytes.reduce((sum, bytes) => sum + bytes.length, 0);
+    let codePtr = 0, errorPtr = 0, programPtr = 0, jobsPtr = 0, inputPtr = 0, outputPtr = 0;
+    let cancelPollPtr = 0;
+    const flagIndex = vm.cancelFlag() >> 2;
+    const onAbort = () => Atomics.store(vm.module.HEAP32, flagIndex, 1);
+    try {
+        Atomics.store(vm.module.HEAP32, flagIndex, 0);
+        if (signal) signal.addEventListener('abort', onAbort, { once: true });
+        if (cancelFlag || timeoutAt !== Infinity) {
+            const poll = () => ((cancelFlag && Atomics.load(cancelFlag, 0) !== 0) || performance.now() > timeoutAt ? 1 : 0);
+            cancelPollPtr = Number(vm.module.addFunction(poll, 'i'));
+        }
+        codePtr = vm.alloc(codeBytes.length || 1);
+        errorPtr = vm.alloc(4);
+        jobsPtr = vm.alloc(inputs.length * BATCH_JOB_SIZE);
+        inputPtr = vm.alloc(inputTotal || 1);
+        outputPtr = vm.alloc(inputs.length * maxOutputSize);
+        if (!codePtr || !errorPtr || !jobsPtr || !inputPtr || !outputPtr) {
+            throw new Error("Failed to allocate Wasm heap memory for buffers.");
+        }
+        vm.module.HEAPU8.set(codeBytes, codePtr);
+        programPtr = vm.compileProgram(codePtr, codeBytes.length, errorPtr);
+        if (!programPtr) {
+            const errorCode = vm.module.HEAP32[errorPtr >> 2];
+            throw new Error(`Brainfuck VM Error: ${getErrorMessage(errorCode)} (Code: ${errorCode})`);
+        }
+
+        const heap = vm.module.HEAPU8;
+        const view = new DataView(heap.buffer);
+        let offset = inputPtr;
+        inputBytes.forEach((bytes, k) => {
+            const job = jobsPtr + k * BATCH_JOB_SIZE;
+            heap.set(bytes, offset);
+            view.setUint32(job, offset, true);
+            view.setUint32(job + 4, bytes.length, true);
+            view.setUint32(job + 8, outputPtr + k * maxOutputSize, true);
+            view.setUint32(job + 12, maxOutputSize, true);
+            offset += bytes.length;
+        });
+
+        const resultCode = vm.batchRun(programPtr, jobsPtr, inputs.length, memorySize, engineFlags, threads, cancelPollPtr);
+        if (resultCode < 0) {
+            throw new Error(`Brainfuck VM Error: ${getErrorMessage(resultCode)} (Code: ${resultCode})`);
+        }
+        // A cancel stops the whole batch, so it is reported once rather than per input
+        if (Atomics.load(vm.module.HEAP32, flagIndex) !== 0) {
+            if (performance.now() > timeoutAt && !signal?.aborted) throw timeoutError(timeoutMs);
+            throw new Error(`Brainfuck VM Error: ${getErrorMessage(-13)} (Code: -13)`);
+        }
+
+        // Worker threads may have grown the memory, but everything read here
+        // was allocated before the run, so the views taken above still cover it
+        return inputs.map((input, k) => {
+            const job = jobsPtr + k * BATCH_JOB_SIZE;
+            const errorCode = view.getInt32(job + BATCH_ERROR_OFFSET, true);
+            if (errorCode < 0) {
+                throw new Error(`Input ${k}: Brainfuck VM Error: ${getErrorMessage(errorCode)} (Code: ${errorCode})`);
+            }
+            const length = Number(view.getBigUint64(job + BATCH_RESULT_OFFSET, true));
+            return Buffer.from(heap.buffer, outputPtr + k * maxOutputSize, length).toString('utf8');
+        });
+    } finally {
+        if (programPtr) vm.freeProgram(programPtr);
+        for (const ptr of [codePtr, errorPtr, jobsPtr, inputPtr, outputPtr]) {
+            if (ptr) vm.free(ptr);
+        }
+        if (cancelPollPtr !== 0 && vm.module.removeFunction) {
+            try {
+                vm.module.removeFunction(cancelPollPtr);
+            } catch (removeErr) {
+                // Must not hide the batch's own error
+            }
+        }
+        if (signal) signal.removeEventListener('abort', onAbort);
+        Atomics.store(vm.module.HEAP32, flagIndex, 0);
+    }
+};
+
+/**
+ * Runs one program over many inputs in parallel inside a single Wasm module
+ * (the -pthread build from `npm run build:wasm-threads`). The program is
+ * compiled once into the shared memory; threads take inputs from a lock-free
+ * queue and run each on their own tape. Without that build the inputs run
+ * one after another on the shared instance (without lockstep).
+ * @param {string} code The Brainfuck code to execute.
+ * @param {string[]} inputs One input per run.
+ * @param {object} [options={}] memorySize, maxOutputSize (per input), engine, detectHangs, signal, cancelFlag
+ *                              (as for execute()) plus:
+ * @param {number} [options.timeoutMs] Cancels the whole batch once it has run this long ("Execution Timed Out",
+ *                                     code -13). Like cancelFlag it is polled by the calling thread while the
+ *                                     threads run. The threads build blocks the calling thread, so there a signal
+ *                                     is only seen if it aborts before the batch starts.
+ * @param {number} [options.threads] Threads to use, the calling thread included. Defaults to the available
+ *                                   cores, at most MAX_BATCH_THREADS (8).
+ * @param {boolean} [options.lockstep=false] Run inputs in groups of 16 in SIMD lanes, one instruction for the
+ *                                           whole group; inputs that take another path through the program
+ *                                           continue on their own. Same results, faster when the inputs take
+ *                                           the same path. Works with detectHangs.
+ * @returns {Promise<{ outputs: string[], duration: number, threads: number }>} Outputs in input order.
+ * @throws {Error} For invalid options, code that doesn't compile, a cancel or timeout of the batch (code -13),
+ *                 or the first failing input's error (prefixed with `Input <index>:`).
+ */
+async function executeBatch(code, inputs, options = {}) {
+    const memorySize = options.memorySize ?? DEFAULT_MEMORY_SIZE;
+    const maxOutputSize = options.maxOutputSize ?? DEFAULT_MAX_OUTPUT_SIZE;
+    const engine = options.engine ?? DEFAULT_ENGINE;
+    const requestedThreads = options.threads ?? Math.min(os.availableParallelism?.() ?? os.cpus().length, MAX_BATCH_THREADS);
+    const { signal, cancelFlag, timeoutMs } = options;
+
+    if (!Array.isArray(inputs)) throw new Error("Invalid argument: inputs must be an array of strings.");
+    if (memorySize <= 0) throw new Error("Invalid option: memorySize must be positive.");
+    if (maxOutputSize <= 0) throw new Error("Invalid option: maxOutputSize must be positive.");
+    if (!(engine in ENGINE_FLAGS)) {
+        throw new Error(`Invalid option: engine must be one of ${Object.keys(ENGINE_FLAGS).join(', ')}.`);
+    }
+    if (!Number.isInteger(requestedThreads) || requestedThreads <= 0) {
+        throw new Error("Invalid option: threads must be a positive integer.");
+    }
+    if (cancelFlag !== undefined && !(cancelFlag instanceof Int32Array && cancelFlag.buffer instanceof SharedArrayBuffer)) {
+        throw new Error("Invalid option: cancelFlag must be an Int32Array on a SharedArrayBuffer.");
+    }
+    if (timeoutMs !== undefined && !(timeoutMs >= 0)) throw new Error("Invalid option: timeoutMs must be a non-negative number.");
+    if (signal?.aborted || (cancelFlag && Atomics.load(cancelFlag, 0) !== 0)) {
+        throw new Error(`Brainfuck VM Error: ${getErrorMessage(-13)} (Code: -13)`);
+    }
+
+    const startTime = performance.now();
+    const timeoutAt = timeoutMs === undefined ? Infinity : startTime + timeoutMs;
+    const vm = await loadThreads();
+    if (!vm) {
+        const runOptions = { memorySize, maxOutputSize, engine, detectHangs: options.detectHangs, signal, cancelFlag };
+        const outputs = [];
+        for (const [k, input] of inputs.entries()) {
+            // The batch's timeout is shared by its runs
+            if (performance.now() > timeoutAt) throw timeoutError(timeoutMs);
+            const runTimeout = timeoutAt === Infinity ? undefined : timeoutAt - performance.now();
+            try {
+                outputs.push((await execute(code, input, { ...runOptions, timeoutMs: runTimeout })).output);
+            } catch (err) {
+                // Cancelling stops the batch, not an input: report it as such
+                if (/\(Code: -13\)$/.test(err.message)) {
+                    throw performance.now() > timeoutAt && !signal?.aborted ? timeoutError(timeoutMs) : err;
+                }
+                throw new Error(`Input ${k}: ${err.message}`);
+            }
+        }
+        return { outputs, duration: performance.now() - startTime, threads: 1 };
+    }
+
+    if (inputs.length * maxOutputSize > WASM32_MAX_RUN_BYTES) {
+        throw new Error("Invalid option: inputs.length * maxOutputSize doesn't fit the Wasm heap.");
+    }
+    const threads = Math.min(requestedThreads, MAX_BATCH_THREADS, Math.max(inputs.length, 1));
+    const engineFlags = ENGINE_FLAGS[engine] | (options.detectHangs ? ENGINE_HANG_DETECT : 0) |
+        (options.lockstep ? ENGINE_LOCKSTEP : 0);
+    const outputs = runBatchThreaded(vm, code, inputs, memorySize, maxOutputSize, engineFlags, threads,
+        { signal, cancelFlag, timeoutAt, timeoutMs });
+    return { outputs, duration: performance.now() - startTime, threads };
+}
+
+/**
+ * Runs code on the native addon (libuv threadpool) instead of the Wasm
+ * engine, keeping the event loop free. See lib/native.js for the options.
+ */
+function executeNative(code, input = '', options = {}) {
+    return runNative({
+        ENGINE_FLAGS, ENGINE_HANG_DETECT, DEFAULT_MEMORY_SIZE, DEFAULT_MAX_OUTPUT_SIZE, DEFAULT_ENGINE, getErrorMessage
+    }, code, input, options);
+}
+
+/**
+ * Creates a scheduler that time-slices runs on the shared engine, with
+ * priority classes and per-tenant fair sharing. See lib/scheduler.js.
+ * @param {object} [options={}] classes, weights, quota.
+ * @returns {Scheduler}
+ */
+function createScheduler(options = {}) {
+    return new Scheduler({
+        getInstance: async () => {
+            await initializeEngine();
+            return shared;
+        },
+        ENGINE_FLAGS, ENGINE_HANG_DETECT, DEFAULT_MEMORY_SIZE, DEFAULT_MAX_OUTPUT_SIZE, DEFAULT_ENGINE, getErrorMessage
+    }, options);
 }
 
 // Export the public API
 module.exports = {
     execute,
+    executeSync,
+    executeRecords,
+    executeBatch,
+    executeNative,
+    nativeAvailable,
+    createScheduler,
     initializeEngine,
+    prewarm,
     DEFAULT_MEMORY_SIZE,
-    DEFAULT_MAX_OUTPUT_SIZE
+    DEFAULT_MAX_OUTPUT_SIZE,
+    DEFAULT_ENGINE,
+    DEFAULT_ISOLATE_THRESHOLD,
+    MAX_BATCH_THREADS,
+    ResultCache,
+    MemoryStore,
+    FileStore,
+    QuotaManager
 };
\ No newline at end of file
@@ -0,0 +1,100 @@
+// lib/native.js - OPTIONAL NATIVE ADDON (libuv threadpool execution)
+
+const path = require('path');
+
+// Built by `npm run build:addon` (node-gyp, see binding.gyp)
+const addonPath = path.resolve(__dirname, '..', 'build', 'Release', 'bfvm.node');
+
+let addon;       // undefined: not tried yet, null: unavailable
+let addonError = null;
+
+const loadAddon = () => {
+    if (addon === undefined) {
+        try {
+            addon = require(addonPath);
+        } catch (err) {
+            addon = null;
+            addonError = err;
+        }
+    }
+    return addon;
+};
+
+const toBytes = (value, name) => {
+    if (typeof value === 'string') return Buffer.from(value, 'utf8');
+    if (value instanceof Uint8Array) return value; // Used in place (Buffer included)
+    throw new Error(`Invalid argument: ${name} must be a string, Buffer or Uint8Array.`);
+};
+
+/**
+ * True if the native addon is built and loads in this process.
+ * @returns {boolean}
+ */
+function nativeAvailable() {
+    return loadAddon() !== null;
+}
+
+/**
+ * Runs Brainfuck code with the native core on the libuv threadpool, so the
+ * event loop stays free and concurrent calls use several cores (up to
+ * UV_THREADPOOL_SIZE, 4 by default). Buffers are read and written in place.
+ * @param {object} vm Engine flags, defaults and getErrorMessage of lib/index.js.
+ * @param {string|Uint8Array} code
+ * @param {string|Uint8Array} [input='']
+ * @param {object} [options={}] memorySize, maxOutputSize, engine, detectHangs, signal, cancelFlag (as for
+ *                              execute()) plus:
+ * @param {string} [options.encoding='utf8'] Output encoding, or 'buffer' for the raw bytes (a view, no copy).
+ * @returns {Promise<{ output: string|Buffer, duration: number, inputRead: number }>}
+ */
+async function executeNative(vm, code, input = '', options = {}) {
+    if (!loadAddon()) {
+        throw new Error(`Native addon not available (run 'npm run build:addon'): ${addonError.message}`);
+    }
+    const memorySize = options.memorySize ?? vm.DEFAULT_MEMORY_SIZE;
+    const maxOutputSize = options.maxOutputSize ?? vm.DEFAULT_MAX_OUTPUT_SIZE;
+    const engine = options.engine ?? vm.DEFAULT_ENGINE;
+    const encoding = options.encoding ?? 'utf8';
+    const { signal, cancelFlag } = options;
+
+    if (!(memorySize > 0)) throw new Error("Invalid option: memorySize must be positive.");
+    if (!(maxOutputSize > 0)) throw new Error("Invalid option: maxOutputSize must be positive.");
+    if (!(engine in vm.ENGINE_FLAGS)) {
+        throw new Error(`Invalid option: engine must be one of ${Object.keys(vm.ENGINE_FLAGS).join(', ')}.`);
+    }
+    if (cancelFlag !== undefined && !(cancelFlag instanceof Int32Array)) {
+        throw new Error("Invalid option: cancelFlag must be an Int32Array.");
+    }
+    if (signal?.aborted || (cancelFlag && Atomics.load(cancelFlag, 0) !== 0)) {
+        throw new Error(`Brainfuck VM Error: ${vm.getErrorMessage(-13)} (Code: -13)`);
+    }
+
+    // The worker thread polls element 0; a signal gets its own flag
+    const cancel = signal && !cancelFlag ? new Int32Array(1) : cancelFlag;
+    const onAbort = () => { cancel[0] = 1; };
+    if (signal) signal.addEventListener('abort', onAbort, { once: true });
+
+    const output = Buffer.allocUnsafeSlow(maxOutputSize);
+    const engineFlags = vm.ENGINE_FLAGS[engine] | (options.detectHangs ? vm.ENGINE_HANG_DETECT : 0);
+    let resultCode, outputLength, inputRead, duration;
+    try {
+        [resultCode, outputLength, inputRead, duration] = await addon.run(
+            toBytes(code, 'code'), toBytes(input, 'input'), output, memorySize, engineFlags, cancel);
+    } finally {
+        if (signal) signal.removeEventListener('abort', onAbort);
+    }
+
+    if (resultCode < 0) {
+        throw new Error(`Brainfuck VM Error: ${vm.getErrorMessage(resultCode)} (Code: ${resultCode})`);
+    }
+    const bytes = output.subarray(0, outputLength);
+    return {
+        output: encoding === 'buffer' ? bytes : bytes.toString(encoding),
+        duration,
+        inputRead
+    };
+}
+
+module.exports = {
+    executeNative,
+    nativeAvailable
+};
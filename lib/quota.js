@@ -0,0 +1,183 @@
+// lib/quota.js - PER-TENANT RESOURCE QUOTAS
+
+// Usage is counted per tenant key over fixed windows that start with the
+// tenant's first run: ops (loop back-edges from the core's BfvmResult.ops),
+// tape bytes (memorySize of every run admitted), output bytes and run time
+// (how long runs occupied the thread, i.e. CPU time for the synchronous
+// engine). A tenant at or over any limit is not admitted to a new run until
+// its window rolls over: 'reject' fails at once, 'throttle' waits for the
+// rollover (up to maxWaitMs).
+
+const DEFAULT_WINDOW_MS = 60 * 1000;
+const QUOTA_KEYS = ['ops', 'tapeBytes', 'outputBytes', 'cpuMs'];
+
+const quotaError = (tenant, key, resetsIn) => {
+    const err = new Error(`Quota Exceeded: tenant "${tenant}" is over its ${key} quota (resets in ${(resetsIn / 1000).toFixed(1)} s).`);
+    err.code = 'ERR_QUOTA_EXCEEDED';
+    return err;
+};
+
+const abortError = () => new Error("Brainfuck VM Error: Execution Cancelled. (Code: -13)");
+
+class QuotaManager {
+    /**
+     * @param {object} [options={}]
+     * @param {object} [options.limits={}] Default limits per window: ops, tapeBytes, outputBytes, cpuMs (unset = unlimited).
+     * @param {object} [options.tenants={}] Per-tenant limits by tenant key, merged over `limits`.
+     * @param {number} [options.windowMs=60000] Accounting window.
+     * @param {string} [options.mode='reject'] 'reject' or 'throttle' (wait for the window to roll over).
+     * @param {number} [options.maxWaitMs=windowMs] Longest a throttled run waits before it is rejected.
+     */
+    constructor(options = {}) {
+        this.limits = options.limits ?? {};
+        this.tenantLimits = new Map(Object.entries(options.tenants ?? {}));
+        this.windowMs = options.windowMs ?? DEFAULT_WINDOW_MS;
+        this.mode = options.mode ?? 'reject';
+        this.maxWaitMs = options.maxWaitMs ?? this.windowMs;
+        this.usages = new Map(); // tenant key -> { windowStart, ops, tapeBytes, outputBytes, cpuMs, runs }
+        this.rejected = 0;
+        this.throttled = 0;
+
+        if (!(this.windowMs > 0)) throw new Error("Invalid option: windowMs must be positive.");
+        if (this.mode !== 'reject' && this.mode !== 'throttle') {
+            throw new Error("Invalid option: mode must be 'reject' or 'throttle'.");
+        }
+    }
+
+    /**
+     * Sets (merges) a tenant's limits.
+     * @param {string} tenant
+     * @param {object} limits ops, tapeBytes, outputBytes, cpuMs.
+     */
+    setLimits(tenant, limits) {
+        this.tenantLimits.set(tenant, { ...this.tenantLimits.get(tenant), ...limits });
+    }
+
+    limitsFor(tenant) {
+        return { ...this.limits, ...this.tenantLimits.get(tenant) };
+    }
+
+    // Usage in the current window (a new window starts once the last one is over)
+    usageOf(tenant, now = performance.now()) {
+        let usage = this.usages.get(tenant);
+        if (!usage || now >= usage.windowStart + this.windowMs) {
+            usage = { windowStart: now, ops: 0, tapeBytes: 0, outputBytes: 0, cpuMs: 0, runs: 0 };
+            this.usages.set(tenant, usage);
+        }
+        return usage;
+    }
+
+    // First quota a run of `memorySize` cells would exceed, or null
+    exceeded(tenant, memorySize) {
+        const limits = this.limitsFor(tenant);
+        const usage = this.usageOf(tenant);
+        for (const key of QUOTA_KEYS) {
+            const limit = limits[key];
+            if (limit === undefined) continue;
+            if (usage[key] >= limit || (key === 'tapeBytes' && usage.tapeBytes + memorySize > limit)) return key;
+        }
+        return null;
+    }
+
+    /**
+     * Admits a run for `tenant` (waiting first in 'throttle' mode) and reserves its tape.
+     * @param {string} tenant
+     * @param {object} run memorySize, maxOutputSize and an optional AbortSignal (signal).
+     * @returns {Promise<{ maxOutputSize: number, ops: number, cpuMs: number }>} The run's output limit capped by
+     *          the tenant's remaining output bytes, and the ops and run time left in the window (Infinity if unlimited).
+     * @throws {Error} With code 'ERR_QUOTA_EXCEEDED' when over quota (and not throttled), or on abort.
+     */
+    async admit(tenant, { memorySize, maxOutputSize, signal }) {
+        let key = this.exceeded(tenant, memorySize);
+        if (key && this.mode === 'throttle') {
+            const usage = this.usageOf(tenant);
+            const resetsIn = usage.windowStart + this.windowMs - performance.now();
+            if (resetsIn <= this.maxWaitMs && this.fitsWindow(tenant, memorySize)) {
+                this.throttled++;
+                await new Promise((resolve, reject) => {
+                    const timer = setTimeout(() => {
+                        signal?.removeEventListener('abort', onAbort);
+                        resolve();
+                    }, Math.max(0, resetsIn));
+                    const onAbort = () => {
+                        clearTimeout(timer);
+                        reject(abortError());
+                    };
+                    signal?.addEventListener('abort', onAbort, { once: true });
+                });
+                key = this.exceeded(tenant, memorySize); // Other runs may have used the new window already
+            }
+        }
+        if (key) {
+            const usage = this.usageOf(tenant);
+            this.rejected++;
+            throw quotaError(tenant, key, usage.windowStart + this.windowMs - performance.now());
+        }
+
+        const usage = this.usageOf(tenant);
+        usage.tapeBytes += memorySize;
+        usage.runs++;
+        const { ops, outputBytes, cpuMs } = this.remaining(tenant);
+        return { maxOutputSize: Math.min(maxOutputSize, outputBytes), ops, cpuMs };
+    }
+
+    /**
+     * What is left of the tenant's ops, outputBytes and cpuMs in the current window (Infinity if unlimited).
+     * @param {string} tenant
+     * @returns {{ ops: number, outputBytes: number, cpuMs: number }}
+     */
+    remaining(tenant) {
+        const limits = this.limitsFor(tenant);
+        const usage = this.usageOf(tenant);
+        return {
+            ops: (limits.ops ?? Infinity) - usage.ops,
+            outputBytes: (limits.outputBytes ?? Infinity) - usage.outputBytes,
+            cpuMs: (limits.cpuMs ?? Infinity) - usage.cpuMs
+        };
+    }
+
+    // A run that needs more tape than a whole window allows never fits: waiting is pointless
+    fitsWindow(tenant, memorySize) {
+        const limit = this.limitsFor(tenant).tapeBytes;
+        return limit === undefined || memorySize <= limit;
+    }
+
+    /**
+     * Adds what a run used (also for failed runs). Tape is counted at admission.
+     * @param {string} tenant
+     * @param {object} used ops, outputBytes, cpuMs.
+     */
+    charge(tenant, { ops = 0, outputBytes = 0, cpuMs = 0 }) {
+        const usage = this.usageOf(tenant);
+        usage.ops += ops;
+        usage.outputBytes += outputBytes;
+        usage.cpuMs += cpuMs;
+    }
+
+    /**
+     * Error for a run stopped mid-way for going over `key` (see lib/scheduler.js).
+     */
+    overQuotaError(tenant, key) {
+        const usage = this.usageOf(tenant);
+        return quotaError(tenant, key, usage.windowStart + this.windowMs - performance.now());
+    }
+
+    /**
+     * Current window's usage and limits per tenant, plus admission counters.
+     * @returns {{ tenants: object, rejected: number, throttled: number }}
+     */
+    stats() {
+        const now = performance.now();
+        const tenants = {};
+        for (const tenant of this.usages.keys()) {
+            const { windowStart, ...usage } = this.usageOf(tenant, now);
+            tenants[tenant] = { ...usage, limits: this.limitsFor(tenant), resetsIn: windowStart + this.windowMs - now };
+        }
+        return { tenants, rejected: this.rejected, throttled: this.throttled };
+    }
+}
+
+module.exports = {
+    QuotaManager,
+    DEFAULT_WINDOW_MS
+};
@@ -0,0 +1,20 @@
+// lib/records-worker.js - WORKER THREAD FOR executeRecords()
+
+const { parentPort, workerData } = require('worker_threads');
+const { execute } = require('./index');
+
+const { code, options } = workerData;
+
+// Runs one chunk of records per message; the first failing record aborts the chunk
+parentPort.on('message', async ({ chunk, start, records }) => {
+    const outputs = new Array(records.length);
+    for (let i = 0; i < records.length; i++) {
+        try {
+            outputs[i] = (await execute(code, records[i], options)).output;
+        } catch (err) {
+            parentPort.postMessage({ chunk, record: start + i, error: err instanceof Error ? err.message : String(err) });
+            return;
+        }
+    }
+    parentPort.postMessage({ chunk, outputs });
+});
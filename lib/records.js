@@ -0,0 +1,156 @@
+// lib/records.js - RECORD-ORIENTED (PER-LINE) EXECUTION
+
+const path = require('path');
+
+const DEFAULT_DELIMITER = '\n';
+const CHUNKS_PER_WORKER = 8; // Work is handed out in chunks so fast workers take more
+
+// Options that are forwarded to execute() for every record. Everything else
+// (debugging, caching) doesn't apply to batch runs or can't cross a thread.
+const RECORD_OPTIONS = ['memorySize', 'maxOutputSize', 'engine', 'detectHangs', 'signal', 'cancelFlag'];
+
+// Splits input into records that each keep their trailing delimiter, so
+// programs that read up to the delimiter see it exactly as they would in a
+// single run. A final record without delimiter is kept; an empty tail isn't.
+const splitRecords = (input, delimiter) => {
+    const records = [];
+    let start = 0;
+    while (start < input.length) {
+        const end = input.indexOf(delimiter, start);
+        if (end === -1) {
+            records.push(input.slice(start));
+            break;
+        }
+        records.push(input.slice(start, end + delimiter.length));
+        start = end + delimiter.length;
+    }
+    return records;
+};
+
+const pickRecordOptions = (options) => {
+    const picked = {};
+    for (const name of RECORD_OPTIONS) {
+        if (options[name] !== undefined) picked[name] = options[name];
+    }
+    return picked;
+};
+
+// One worker per thread, fed chunks of records until none are left. Results
+// are written by chunk index so the output order matches the input order.
+const runOnWorkers = (code, records, runOptions, workers, signal) => new Promise((resolve, reject) => {
+    const chunkSize = Math.max(1, Math.ceil(records.length / (workers * CHUNKS_PER_WORKER)));
+    const chunkCount = Math.ceil(records.length / chunkSize);
+    const outputs = new Array(chunkCount);
+    const pool = [];
+    let nextChunk = 0;
+    let doneChunks = 0;
+    let failed = false;
+
+    // Workers poll this flag (via execute's cancelFlag) at loop back-edges
+    const cancelFlag = runOptions.cancelFlag ?? (signal ? new Int32Array(new SharedArrayBuffer(4)) : undefined);
+    const workerOptions = { ...runOptions };
+    delete workerOptions.signal; // Can't cross threads; relayed through the flag
+    if (cancelFlag) workerOptions.cancelFlag = cancelFlag;
+
+    const onAbort = () => {
+        Atomics.store(cancelFlag, 0, 1);
+        finish(new Error("Brainfuck VM Error: Execution Cancelled. (Code: -13)"));
+    };
+    const finish = (err) => {
+        if (failed) return;
+        if (err) failed = true;
+        if (signal) signal.removeEventListener('abort', onAbort);
+        for (const worker of pool) worker.terminate();
+        if (err) reject(err);
+        else resolve(outputs.flat());
+    };
+    if (signal) signal.addEventListener('abort', onAbort, { once: true });
+
+    const dispatch = (worker) => {
+        if (nextChunk >= chunkCount) return;
+        const chunk = nextChunk++;
+        const start = chunk * chunkSize;
+        worker.postMessage({ chunk, start, records: records.slice(start, start + chunkSize) });
+    };
+
+    for (let i = 0; i < Math.min(workers, chunkCount); i++) {
+        const { Worker } = require('worker_threads'); // Only when used (keeps snapshots lean)
+        const worker = new Worker(path.join(__dirname, 'records-worker.js'), {
+            workerData: { code, options: workerOptions }
+        });
+        worker.on('message', (msg) => {
+            if ('error' in msg) {
+                finish(new Error(`Record ${msg.record}: ${msg.error}`));
+                return;
+            }
+            outputs[msg.chunk] = msg.outputs;
+            if (++doneChunks === chunkCount) finish();
+            else dispatch(worker);
+        });
+        worker.on('error', finish);
+        // A worker that goes away with its chunk unposted (process.exit, an outside terminate)
+        worker.on('exit', (exitCode) => {
+            if (!failed && doneChunks < chunkCount) finish(new Error(`Record worker exited with code ${exitCode}`));
+        });
+        pool.push(worker);
+        dispatch(worker);
+    }
+});
+
+/**
+ * Runs a stateless per-record program once per record of the input and
+ * concatenates the outputs in input order.
+ * @param {function} execute The execute() function of lib/index.js.
+ * @param {string} code The Brainfuck code, run independently for each record.
+ * @param {string} [input=''] Input holding delimiter-terminated records.
+ * @param {object} [options={}] execute() options (memorySize, maxOutputSize, engine, detectHangs, signal,
+ *                              cancelFlag) plus:
+ * @param {string} [options.delimiter='\n'] Record delimiter; each record is passed with its delimiter.
+ * @param {number} [options.workers=1] Worker threads; 1 runs all records on the calling thread.
+ * @returns {Promise<{ output: string, records: number, duration: number }>}
+ */
+async function executeRecords(execute, code, input = '', options = {}) {
+    const delimiter = options.delimiter ?? DEFAULT_DELIMITER;
+    const workers = options.workers ?? 1;
+
+    if (typeof delimiter !== 'string' || delimiter.length === 0) {
+        throw new Error("Invalid option: delimiter must be a non-empty string.");
+    }
+    if (!Number.isInteger(workers) || workers < 1) {
+        throw new Error("Invalid option: workers must be a positive integer.");
+    }
+
+    if (options.signal?.aborted) {
+        throw new Error("Brainfuck VM Error: Execution Cancelled. (Code: -13)");
+    }
+
+    const records = splitRecords(input, delimiter);
+    const runOptions = pickRecordOptions(options);
+    const startTime = performance.now();
+    let outputs;
+
+    if (workers === 1 || records.length <= 1) {
+        outputs = new Array(records.length);
+        for (let i = 0; i < records.length; i++) {
+            try {
+                outputs[i] = (await execute(code, records[i], runOptions)).output;
+            } catch (err) {
+                throw new Error(`Record ${i}: ${err.message}`);
+            }
+        }
+    } else {
+        outputs = await runOnWorkers(code, records, runOptions, workers, options.signal);
+    }
+
+    return {
+        output: outputs.join(''),
+        records: records.length,
+        duration: performance.now() - startTime
+    };
+}
+
+module.exports = {
+    executeRecords,
+    splitRecords,
+    DEFAULT_DELIMITER
+};
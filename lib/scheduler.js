@@ -0,0 +1,447 @@
+// lib/scheduler.js - PRIORITY CLASSES AND FAIR TIME-SLICING
+
+// Runs share the main thread in slices: each slice resumes a run's instance
+// for a budget of ops (loop back-edges, see BfvmResult.ops in bfvm.h) sized
+// to the class's slice time, then yields to the event loop so new requests
+// get queued. Classes are served in strict priority order; inside a class,
+// tenants share the ops by weight (weighted fair queueing on virtual time),
+// and each tenant's runs take turns.
+
+const DEFAULT_CLASSES = {
+    // Slices of lower classes are capped so an arriving interactive run waits
+    // at most a fraction of latencyTargetMs; interactive runs that have run
+    // longer than the target are demoted to `demoteTo`
+    interactive: { priority: 0, sliceMs: 5, latencyTargetMs: 50, demoteTo: 'batch' },
+    batch: { priority: 1, sliceMs: 20 }
+};
+const DEFAULT_CLASS = 'interactive';
+const DEFAULT_TENANT = 'default';
+
+const LATENCY_SLICE_FRACTION = 4; // Lower-class slices are at most latencyTargetMs / this
+const LATENCY_SAMPLES = 1024;     // Latencies kept per class for the percentiles
+const MIN_SLICE_OPS = 1024;
+const MAX_SLICE_OPS = 2 ** 31;    // max_ops is a size_t in the wasm32 heap
+const INITIAL_OPS_PER_MS = 4096;  // Slice sizing before a run has been measured
+const RATE_SMOOTHING = 0.5;       // Weight of the latest slice in a run's ops/ms estimate
+
+// Wasm32 layouts (bfvm.h): BfvmConfig { memory_size, engine_flags, io { read, write, user },
+// io_buffer_size } and BfvmResult { output_len, input_read, data_pointer, error, reserved, ops }
+const CONFIG_SIZE = 24;
+const RESULT_SIZE = 40;
+const RESULT_ERROR_OFFSET = 24;
+const RESULT_OPS_OFFSET = 32;
+const BFVM_PAUSED = 1;
+
+// --- Host I/O ---
+// One read/write callback pair per Wasm module; BfvmIO.user is the run id
+const hostIO = new WeakMap(); // module -> { readPtr, writePtr, runs }
+let nextRunId = 1;
+
+const hostIOFor = (module) => {
+    let io = hostIO.get(module);
+    if (!io) {
+        const runs = new Map();
+        const read = (user, buf, capacity) => {
+            const run = runs.get(user);
+            const chunk = run.input.subarray(run.inputPos, run.inputPos + capacity);
+            module.HEAPU8.set(chunk, buf);
+            run.inputPos += chunk.length;
+            return chunk.length;
+        };
+        const write = (user, buf, len) => {
+            const run = runs.get(user);
+            if (run.outputLength + len > run.maxOutputSize) {
+                run.overflow = true;
+                return 1; // Fails the run; reported as an output overflow
+            }
+            run.chunks.push(Buffer.from(module.HEAPU8.slice(buf, buf + len)));
+            run.outputLength += len;
+            return 0;
+        };
+        io = { readPtr: module.addFunction(read, 'iiii'), writePtr: module.addFunction(write, 'iiii'), runs };
+        hostIO.set(module, io);
+    }
+    return io;
+};
+
+// Value at `fraction` of the sorted samples
+const percentile = (sorted, fraction) => (sorted.length
+    ? sorted[Math.min(sorted.length - 1, Math.floor(fraction * sorted.length))]
+    : 0);
+
+class Scheduler {
+    /**
+     * @param {object} engine Engine access from lib/index.js: getInstance(), flags, defaults, getErrorMessage.
+     * @param {object} [options={}]
+     * @param {object} [options.classes] Priority classes by name, merged over DEFAULT_CLASSES:
+     *                                   { priority, sliceMs, latencyTargetMs?, demoteTo? }; lower priority runs first.
+     * @param {object} [options.weights] Tenant weights by tenant key (default 1).
+     * @param {QuotaManager} [options.quota] Admits runs per tenant (lib/quota.js) and charges their slices;
+     *                                       a run is stopped once its tenant has used up its ops or cpuMs.
+     */
+    constructor(engine, options = {}) {
+        this.engine = engine;
+        this.classes = new Map();
+        for (const [name, spec] of Object.entries({ ...DEFAULT_CLASSES, ...options.classes })) {
+            if (!(spec.sliceMs > 0) || !Number.isFinite(spec.priority)) {
+                throw new Error(`Invalid option: class ${name} needs a priority and a positive sliceMs.`);
+            }
+            this.classes.set(name, {
+                name,
+                ...spec,
+                clock: 0,              // Virtual time of the last tenant served
+                queued: 0,
+                completed: 0,
+                failed: 0,
+                demoted: 0,
+                targetMisses: 0,
+                latencies: [],         // Ring buffer of the last LATENCY_SAMPLES end-to-end latencies
+                samples: 0
+            });
+        }
+        for (const cls of this.classes.values()) {
+            if (cls.demoteTo !== undefined && !this.classes.has(cls.demoteTo)) {
+                throw new Error(`Invalid option: class ${cls.name} demotes to unknown class ${cls.demoteTo}.`);
+            }
+        }
+        this.order = [...this.classes.values()].sort((a, b) => a.priority - b.priority);
+        this.weights = new Map(Object.entries(options.weights ?? {}));
+        this.quota = options.quota ?? null;
+        this.tenants = new Map();      // tenant key -> { ops, runTime, completed, vtime, queues: class name -> runs[] }
+        this.scratch = null;           // { vm, configPtr, resultPtr, errorPtr } in the shared Wasm heap
+        this.draining = false;
+    }
+
+    /**
+     * Sets a tenant's share of the ops within each class (default 1).
+     * @param {string} tenant
+     * @param {number} weight
+     */
+    setWeight(tenant, weight) {
+        if (!(weight > 0)) throw new Error("Invalid argument: weight must be positive.");
+        this.weights.set(tenant, weight);
+    }
+
+    /**
+     * Queues a run and resolves when it finishes.
+     * @param {string} code The Brainfuck code to execute.
+     * @param {string} [input='']
+     * @param {object} [options={}] memorySize, maxOutputSize, engine, detectHangs, signal (as for execute()) plus:
+     * @param {string} [options.tenant='default'] Key the run's ops are accounted to.
+     * @param {string} [options.priority='interactive'] Class name.
+     * @returns {Promise<{ output: string, duration: number, runTime: number, ops: number, priority: string }>}
+     *          duration runs from the call to the end of the run; runTime is the time spent in slices.
+     */
+    async execute(code, input = '', options = {}) {
+        const memorySize = options.memorySize ?? this.engine.DEFAULT_MEMORY_SIZE;
+        const maxOutputSize = options.maxOutputSize ?? this.engine.DEFAULT_MAX_OUTPUT_SIZE;
+        const engine = options.engine ?? this.engine.DEFAULT_ENGINE;
+        const tenant = options.tenant ?? DEFAULT_TENANT;
+        const cls = this.classes.get(options.priority ?? DEFAULT_CLASS);
+        const { signal } = options;
+
+        if (!(memorySize > 0)) return Promise.reject(new Error("Invalid option: memorySize must be positive."));
+        if (!(maxOutputSize > 0)) return Promise.reject(new Error("Invalid option: maxOutputSize must be positive."));
+        if (!(engine in this.engine.ENGINE_FLAGS)) {
+            return Promise.reject(new Error(
+                `Invalid option: engine must be one of ${Object.keys(this.engine.ENGINE_FLAGS).join(', ')}.`));
+        }
+        if (!cls) {
+            return Promise.reject(new Error(`Invalid option: priority must be one of ${[...this.classes.keys()].join(', ')}.`));
+        }
+        if (signal?.aborted) return Promise.reject(this.vmError(-13));
+
+        // Over-quota tenants are turned away (or held, when throttling) before they queue
+        const admission = this.quota ? await this.quota.admit(tenant, { memorySize, maxOutputSize, signal }) : null;
+        if (signal?.aborted) throw this.vmError(-13);
+
+        return new Promise((resolve, reject) => {
+            const run = {
+                id: nextRunId++,
+                code,
+                input: Buffer.from(input, 'utf8'),
+                inputPos: 0,
+                memorySize,
+                maxOutputSize: admission ? admission.maxOutputSize : maxOutputSize,
+                outputCapped: admission !== null && admission.maxOutputSize < maxOutputSize,
+                engineFlags: this.engine.ENGINE_FLAGS[engine] | (options.detectHangs ? this.engine.ENGINE_HANG_DETECT : 0),
+                tenant,
+                cls,
+                chunks: [],
+                outputLength: 0,
+                overflow: false,
+                programPtr: 0,
+                instancePtr: 0,
+                ops: 0,
+                runTime: 0,
+                opsPerMs: INITIAL_OPS_PER_MS,
+                submitted: performance.now(),
+                signal,
+                onAbort: null,
+                resolve,
+                reject
+            };
+            if (signal) {
+                // Slices run to completion, so an abort always lands between them
+                run.onAbort = () => {
+                    this.dequeue(run);
+                    this.finish(run, -13);
+                };
+                signal.addEventListener('abort', run.onAbort, { once: true });
+            }
+            this.enqueue(run);
+            this.drain();
+        });
+    }
+
+    /**
+     * Queue depths, latency percentiles (ms, over the last 1024 runs) per class and usage per tenant.
+     * Runs are counted in the class they finished in (after any demotion).
+     * @returns {{ classes: object, tenants: object }}
+     */
+    stats() {
+        const classes = {};
+        for (const cls of this.order) {
+            const sorted = [...cls.latencies].sort((a, b) => a - b);
+            classes[cls.name] = {
+                queued: cls.queued,
+                completed: cls.completed,
+                failed: cls.failed,
+                demoted: cls.demoted,
+                targetMisses: cls.targetMisses,
+                p50: percentile(sorted, 0.5),
+                p99: percentile(sorted, 0.99)
+            };
+        }
+        const tenants = {};
+        for (const [key, tenant] of this.tenants) {
+            const queued = Object.values(tenant.queues).reduce((sum, runs) => sum + runs.length, 0);
+            tenants[key] = {
+                weight: this.weightOf(key), ops: tenant.ops, runTime: tenant.runTime, completed: tenant.completed, queued
+            };
+        }
+        return { classes, tenants };
+    }
+
+    // --- Queues ---
+    weightOf(tenant) {
+        return this.weights.get(tenant) ?? 1;
+    }
+
+    tenantOf(key) {
+        let tenant = this.tenants.get(key);
+        if (!tenant) {
+            tenant = { ops: 0, runTime: 0, completed: 0, vtime: {}, queues: {} };
+            this.tenants.set(key, tenant);
+        }
+        return tenant;
+    }
+
+    enqueue(run) {
+        const tenant = this.tenantOf(run.tenant);
+        const name = run.cls.name;
+        const queue = tenant.queues[name] ??= [];
+        // A tenant that was idle in this class starts at the class's clock:
+        // being idle earns no credit
+        if (queue.length === 0) tenant.vtime[name] = Math.max(tenant.vtime[name] ?? 0, run.cls.clock);
+        queue.push(run);
+        run.cls.queued++;
+    }
+
+    dequeue(run) {
+        const queue = this.tenants.get(run.tenant).queues[run.cls.name];
+        const index = queue.indexOf(run);
+        if (index !== -1) {
+            queue.splice(index, 1);
+            run.cls.queued--;
+        }
+    }
+
+    // Highest-priority class with work, and in it the tenant furthest behind
+    pick() {
+        for (const cls of this.order) {
+            if (cls.queued === 0) continue;
+            let best = null;
+            for (const tenant of this.tenants.values()) {
+                const queue = tenant.queues[cls.name];
+                if (queue?.length && (!best || tenant.vtime[cls.name] < best.vtime[cls.name])) best = tenant;
+            }
+            cls.clock = best.vtime[cls.name];
+            return best.queues[cls.name][0];
+        }
+        return null;
+    }
+
+    // Slice time of a class: its own sliceMs, capped by the latency targets of higher classes
+    sliceMsOf(cls) {
+        let sliceMs = cls.sliceMs;
+        for (const other of this.order) {
+            if (other === cls) break;
+            if (other.latencyTargetMs) sliceMs = Math.min(sliceMs, other.latencyTargetMs / LATENCY_SLICE_FRACTION);
+        }
+        return sliceMs;
+    }
+
+    // --- Slices ---
+    // One slice at a time, with a turn of the event loop in between
+    async drain() {
+        if (this.draining) return;
+        this.draining = true;
+        try {
+            if (!this.scratch) await this.setup();
+            for (let run = this.pick(); run; run = this.pick()) {
+                this.slice(run);
+                await new Promise(resolve => setImmediate(resolve));
+            }
+        } catch (err) {
+            // The engine didn't load or a call into it threw: fail what is queued
+            for (let run = this.pick(); run; run = this.pick()) {
+                this.dequeue(run);
+                this.finish(run, 0, err instanceof Error ? err : new Error(String(err)));
+            }
+        } finally {
+            this.draining = false;
+        }
+    }
+
+    // Scratch for the config, the result and error codes in the shared Wasm heap
+    async setup() {
+        const vm = await this.engine.getInstance();
+        const configPtr = vm.alloc(CONFIG_SIZE + RESULT_SIZE + 8);
+        if (!configPtr) throw new Error("Failed to allocate Wasm heap memory for buffers.");
+        this.scratch = { vm, configPtr, resultPtr: configPtr + CONFIG_SIZE, errorPtr: configPtr + CONFIG_SIZE + RESULT_SIZE };
+    }
+
+    slice(run) {
+        const cls = run.cls;
+        const tenant = this.tenants.get(run.tenant);
+        const sliceMs = this.sliceMsOf(cls);
+        let budget = Math.min(MAX_SLICE_OPS, Math.max(MIN_SLICE_OPS, Math.floor(run.opsPerMs * sliceMs)));
+        if (this.quota) budget = Math.max(1, Math.min(budget, this.quota.remaining(run.tenant).ops));
+        const startTime = performance.now();
+
+        if (!run.instancePtr) {
+            const errorCode = this.start(run);
+            if (errorCode < 0) {
+                this.dequeue(run);
+                this.finish(run, errorCode);
+                return;
+            }
+        }
+
+        const { vm, resultPtr } = this.scratch;
+        const status = vm.sliceInstance(run.instancePtr, budget, resultPtr);
+        const elapsed = performance.now() - startTime;
+        const view = new DataView(vm.module.HEAPU8.buffer);
+        const ops = Number(view.getBigUint64(resultPtr + RESULT_OPS_OFFSET, true));
+        const sliceOps = ops - run.ops;
+
+        // Accounting: the tenant's virtual time advances by ops over weight
+        run.ops = ops;
+        run.runTime += elapsed;
+        tenant.ops += sliceOps;
+        tenant.runTime += elapsed;
+        tenant.vtime[cls.name] += Math.max(sliceOps, 1) / this.weightOf(run.tenant);
+        if (elapsed > 0.05) {
+            run.opsPerMs = RATE_SMOOTHING * (sliceOps / elapsed) + (1 - RATE_SMOOTHING) * run.opsPerMs;
+        } else if (status === BFVM_PAUSED) {
+            run.opsPerMs *= 2; // Too quick to measure
+        }
+        if (this.quota) this.quota.charge(run.tenant, { ops: sliceOps, cpuMs: elapsed });
+
+        this.dequeue(run);
+        if (status !== BFVM_PAUSED) {
+            this.finish(run, status === 0 ? 0 : view.getInt32(resultPtr + RESULT_ERROR_OFFSET, true));
+            return;
+        }
+        if (this.quota) {
+            const left = this.quota.remaining(run.tenant);
+            const key = left.ops <= 0 ? 'ops' : left.cpuMs <= 0 ? 'cpuMs' : null;
+            if (key) {
+                this.finish(run, 0, this.quota.overQuotaError(run.tenant, key));
+                return;
+            }
+        }
+        if (cls.latencyTargetMs && cls.demoteTo && run.runTime > cls.latencyTargetMs) {
+            cls.demoted++;
+            run.cls = this.classes.get(cls.demoteTo);
+        }
+        this.enqueue(run); // Back of its tenant's queue
+    }
+
+    // Compiles the program and creates the instance on the run's first slice,
+    // so queued runs hold no Wasm memory. Returns 0 or a BF_ERR_* code.
+    start(run) {
+        const { vm, configPtr, errorPtr } = this.scratch;
+        const io = hostIOFor(vm.module);
+        const codeBytes = Buffer.from(run.code, 'utf8');
+        const codePtr = vm.alloc(codeBytes.length || 1);
+        if (!codePtr) return -6;
+        try {
+            vm.module.HEAPU8.set(codeBytes, codePtr);
+            run.programPtr = vm.compileProgram(codePtr, codeBytes.length, errorPtr);
+        } finally {
+            vm.free(codePtr);
+        }
+        if (!run.programPtr) return vm.module.HEAP32[errorPtr >> 2];
+
+        const view = new DataView(vm.module.HEAPU8.buffer);
+        view.setUint32(configPtr, run.memorySize, true);
+        view.setInt32(configPtr + 4, run.engineFlags, true);
+        view.setUint32(configPtr + 8, io.readPtr, true);
+        view.setUint32(configPtr + 12, io.writePtr, true);
+        view.setUint32(configPtr + 16, run.id, true);
+        view.setUint32(configPtr + 20, 0, true); // Default buffer size
+        run.instancePtr = vm.createInstance(run.programPtr, configPtr, errorPtr);
+        if (!run.instancePtr) return vm.module.HEAP32[errorPtr >> 2];
+        io.runs.set(run.id, run);
+        return 0;
+    }
+
+    // Frees the run's Wasm state and settles its promise (error < 0: VM error code)
+    finish(run, errorCode, err = null) {
+        if (this.scratch) {
+            const vm = this.scratch.vm;
+            if (run.instancePtr) vm.freeInstance(run.instancePtr);
+            if (run.programPtr) vm.freeProgram(run.programPtr);
+            hostIO.get(vm.module)?.runs.delete(run.id);
+        }
+        run.instancePtr = run.programPtr = 0;
+        if (run.signal) run.signal.removeEventListener('abort', run.onAbort);
+
+        const cls = run.cls;
+        const tenant = this.tenants.get(run.tenant);
+        const duration = performance.now() - run.submitted;
+        if (err || errorCode < 0) {
+            cls.failed++;
+            // The write callback refuses output past maxOutputSize (-15): report the overflow,
+            // or the quota when it was the quota's cap that overflowed
+            if (!err && errorCode === -15 && run.overflow) {
+                err = run.outputCapped ? this.quota.overQuotaError(run.tenant, 'outputBytes') : this.vmError(-3);
+            }
+            run.reject(err ?? this.vmError(errorCode));
+            return;
+        }
+        cls.completed++;
+        tenant.completed++;
+        if (this.quota) this.quota.charge(run.tenant, { outputBytes: run.outputLength });
+        cls.latencies[cls.samples++ % LATENCY_SAMPLES] = duration;
+        if (cls.latencyTargetMs && duration > cls.latencyTargetMs) cls.targetMisses++;
+        run.resolve({
+            output: Buffer.concat(run.chunks, run.outputLength).toString('utf8'),
+            duration,
+            runTime: run.runTime,
+            ops: run.ops,
+            priority: cls.name
+        });
+    }
+
+    vmError(errorCode) {
+        return new Error(`Brainfuck VM Error: ${this.engine.getErrorMessage(errorCode)} (Code: ${errorCode})`);
+    }
+}
+
+module.exports = {
+    Scheduler,
+    DEFAULT_CLASSES
+};
@@ -0,0 +1,86 @@
+// lib/snapshot.js - STARTUP SNAPSHOT ENTRY (node --build-snapshot)
+//
+//   node --snapshot-blob bf-vm.blob --build-snapshot node_modules/bf-vm/lib/snapshot.js [programs.json]
+//   node --snapshot-blob bf-vm.blob app.js [args...]
+//
+// The snapshot holds the library with its JS already evaluated and the Wasm
+// binary in memory. WebAssembly isn't available while a snapshot is built, so
+// the module is compiled and instantiated from those bytes as soon as the
+// process starts, together with the programs listed in programs.json (a JSON
+// array of sources), while app.js is loaded. app.js gets the snapshotted
+// library from require('bf-vm') as usual.
+
+const fs = require('fs');
+const path = require('path');
+const v8 = require('v8');
+
+// Snapshot builder scripts can only require built-in modules, so the library
+// files are loaded with a minimal CommonJS loader. Packages from node_modules
+// (chalk) are resolved lazily at run time, after deserialization, so nothing
+// environment-dependent (like color support) is frozen into the snapshot.
+const loadedModules = new Map(); // filename -> { exports }
+
+const lazyPackage = (id) => {
+    let loaded = null;
+    const load = () => {
+        if (!loaded) {
+            const { createRequire } = process.getBuiltinModule('module');
+            loaded = createRequire(path.join(__dirname, 'index.js'))(id);
+        }
+        return loaded;
+    };
+    return new Proxy({}, { get: (target, key) => load()[key] });
+};
+
+const loadFile = (filename) => {
+    if (loadedModules.has(filename)) return loadedModules.get(filename).exports;
+    const module = { exports: {} };
+    loadedModules.set(filename, module);
+    const dirname = path.dirname(filename);
+    const localRequire = (id) => {
+        if (id.startsWith('.') || path.isAbsolute(id)) {
+            const resolved = path.resolve(dirname, id);
+            return loadFile(resolved.endsWith('.js') ? resolved : `${resolved}.js`);
+        }
+        try {
+            return require(id); // Built-in
+        } catch (err) {
+            return lazyPackage(id);
+        }
+    };
+    const wrapper = new Function('exports', 'require', 'module', '__filename', '__dirname',
+        fs.readFileSync(filename, 'utf8'));
+    wrapper(module.exports, localRequire, module, filename, dirname);
+    return module.exports;
+};
+
+const bfvm = loadFile(path.join(__dirname, 'index.js'));
+const programsFile = process.argv[2];
+const programs = programsFile ? JSON.parse(fs.readFileSync(programsFile, 'utf8')) : [];
+if (!Array.isArray(programs) || programs.some(code => typeof code !== 'string')) {
+    throw new Error("Invalid snapshot programs: expected a JSON array of Brainfuck sources.");
+}
+
+v8.startupSnapshot.setDeserializeMainFunction(() => {
+    // Make require() of the library files return the snapshotted instances
+    const Module = process.getBuiltinModule('module');
+    for (const [filename, { exports }] of loadedModules) {
+        const cached = new Module(filename);
+        cached.filename = filename;
+        cached.exports = exports;
+        cached.loaded = true;
+        Module._cache[filename] = cached;
+    }
+
+    // Instantiation starts now and overlaps with loading the app
+    bfvm.prewarm({ programs }).catch(err => {
+        console.error("bf-vm: prewarming the snapshot failed:", err.message);
+    });
+
+    const app = process.argv[1];
+    if (app) {
+        const appPath = path.resolve(app);
+        process.argv[1] = appPath;
+        Module.createRequire(appPath)(appPath);
+    }
+});
@@ -4,29 +4,170 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE __attribute__((visibility("default"))) // Native libbfvm exports
+#endif
+// Native builds and the -pthread Wasm build run batches on several threads
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define BFVM_HAVE_THREADS 1
+#include <pthread.h>
+#include <time.h>
+#endif
 
-// --- Error Codes --- (Add new codes)
-#define BF_SUCCESS 0
-#define BF_ERR_MEMORY_OUT_OF_BOUNDS -1
-#define BF_ERR_INPUT_EOF -2
-#define BF_ERR_OUTPUT_OVERFLOW -3
-#define BF_ERR_UNMATCHED_BRACKET_CLOSE -4 // Now primarily detected during pre-scan
-#define BF_ERR_UNMATCHED_BRACKET_OPEN -5  // Now primarily detected during pre-scan
-#define BF_ERR_TAPE_ALLOC_FAILED -6
-#define BF_ERR_JUMPTABLE_ALLOC_FAILED -7 // New
-#define BF_ERR_STACK_OVERFLOW -8        // New (for pre-scan)
-#define BF_ERR_DEBUG_HALT_REQUESTED -9 // New signal from debug callback
-#define BF_ERR_INVALID_ARGS -10
-#define BF_ERR_BREAKPOINT_ALLOC_FAILED -11 // New
+#include "bfvm.h" // Error codes, engine flags, BfvmResult and the public API
 
 #define MAX_BRACKET_DEPTH 4096 // Limit for bracket nesting stack during pre-scan
 
+// --- Per-Run Arena Tuning ---
+#define ARENA_HEADER 16             // Size header before each block (keeps 16-byte alignment)
+#define ARENA_GRANULE (64 * 1024)   // Arena sizes are rounded up to this
+#define ARENA_SHRINK_FACTOR 4       // Shrink once the last run needed less than 1/4 of it
 
-// --- Debug Callback Function Pointer Type ---
-// Signature: int callback(size_t ip, size_t dp, uint8_t current_cell_value);
-// Return 0 to continue, non-zero (e.g., 1) to halt execution.
-typedef int (*debug_callback_t)(size_t, size_t, uint8_t);
+#define BATCH_MAX_THREADS 64   // Threads a batch may use, the calling thread included
+#define BATCH_POLL_NS 1000000  // Calling thread's cancel_poll interval while it waits for the others
+
+// --- Lockstep Batches (BFVM_ENGINE_LOCKSTEP) ---
+// One lane per job; a row of LOCKSTEP_LANES cells fills one SIMD register
+// (GCC/Clang vector extensions: SSE2/NEON/Wasm SIMD128, or AVX2)
+#if defined(__AVX2__)
+#define LOCKSTEP_LANES 32
+#else
+#define LOCKSTEP_LANES 16
+#endif
+#define LOCKSTEP_MAX_GATHER 256 // Widest AFFINE loop window applied lane by lane
+#define MAX_LOOP_CELLS 16      // Max distinct cells a loop may touch to be run in closed form
+
+// --- Loop Kinds (result of loop analysis) ---
+#define LOOP_KIND_NONE 0
+#define LOOP_KIND_LINEAR 1 // Balanced body of +-<> only: runs in closed form
+#define LOOP_KIND_AFFINE 2 // Balanced body of +-<> and LINEAR inner loops: runs as a matrix power
+#define LOOP_KIND_CLEAR_RANGE 3 // Run of clears/sets at consecutive cells ([-]>[-]+>[-]...)
+
+#define AFFINE_DIM (MAX_LOOP_CELLS + 1) // Cells plus the constant term
+#define AFFINE_POWERS 8                  // M^1, M^2, ..., M^128 cover any 8-bit trip count
+
+// --- Execution Loop Variants ---
+#define VARIANT_FAST 0x0
+#define VARIANT_DEBUG 0x1       // Single-step debug hook before every instruction
+#define VARIANT_HANG_DETECT 0x2 // Loop state fingerprinting at back-edges
+#define VARIANT_STEP 0x4        // Stop after vm->step_budget dispatches (no traces)
+#define VARIANT_WATCH 0x8       // Check cell accesses against the watchpoint bitmap (no traces)
+
+// --- Trace Tier Tuning ---
+#define TRACE_HOT_THRESHOLD 64    // Back-edges before a loop is recorded
+#define TRACE_MAX_OPS 512         // Longest trace (unrolled inner iterations included)
+#define TRACE_MAX_SIDE_EXITS 64   // Exits tolerated before a trace's exit rate is judged
+#define TRACE_MAX_RECORDINGS 4    // Re-recordings before a loop is left to the interpreter
+#define TRACE_BLACKLISTED UINT32_MAX
+#define TRACE_CELL_WINDOW 8       // Cells a cell-cached trace keeps in one 64-bit word
+
+// --- Cancellation ---
+#define CANCEL_POLL_INTERVAL 65536 // Back-edges (or trace iterations) between cancellation polls
+
+// --- Hang Detector Tuning ---
+#define HANG_MAX_WINDOW 64        // Widest cell window a loop state may span
+#define HANG_SLOTS 16             // Loops fingerprinted at once (direct-mapped by ip)
+#define HANG_CHECK_INTERVAL 4     // Back-edges between samples
+#define HANG_WINDOW_NONE 1        // hang_window entry: state not confined to a window
+#define HANG_WINDOW_KNOWN 0x10000 // hang_window entry: (lo+64) << 8 | (hi+64)
+
+// --- Trace Op Kinds ---
+#define TOP_ADD 0           // cell += value
+#define TOP_OUT 1
+#define TOP_IN 2
+#define TOP_GUARD_ZERO 3    // Recorded bracket saw zero; side-exit otherwise
+#define TOP_GUARD_NONZERO 4 // Recorded bracket saw non-zero; side-exit otherwise
+#define TOP_LOOP 5          // Closed-form loop (ref = loop_index entry)
+#define TOP_RANGE 6         // Clear/set run (ref = loop_index entry)
+#define TOP_CALL 7          // Balanced inner loop with its own trace (ref = trace_index entry)
+
+
+// --- Hook Types (see bfvm.h) ---
+typedef bfvm_debug_hook_t debug_callback_t;
+typedef bfvm_cancel_poll_t cancel_poll_t;
+
+
+// --- Loop Descriptor ---
+// A LINEAR loop changes its counter cell (offset 0) by `step` per iteration and
+// every other touched cell by a fixed delta, so the whole loop can be applied
+// at once: trip count t solves cell + t*step == 0 (mod 256).
+// An AFFINE loop's iteration is an affine map x' = M*x (mod 256) over its
+// touched cells (inner LINEAR loops contribute trip counts that are linear in
+// x), so t iterations are M^t applied once. For AFFINE loops offsets[0] is the
+// counter and `powers` holds M^(2^i) as (cell_count+1)^2 matrices.
+// A CLEAR_RANGE starts at a clear loop and stores range_len cells in one go;
+// when it cannot, it falls back to that first clear (end_ip is its ']').
+typedef struct {
+    int kind;
+    size_t end_ip;              // Position of the matching ']'
+    uint8_t step_shift;         // step == step_odd << step_shift
+    uint8_t step_inv;           // Inverse of step_odd mod 256 (step_odd is odd)
+    int cell_count;             // Touched cells other than the counter
+    int32_t offsets[MAX_LOOP_CELLS];
+    uint8_t deltas[MAX_LOOP_CELLS];
+    int32_t min_offset;
+    int32_t max_offset;
+    uint8_t *powers;            // AFFINE only
+
+    // CLEAR_RANGE only
+    size_t range_end_ip;        // Last instruction of the run
+    uint32_t range_first;       // loop_index entry of the first clear
+    size_t range_len;           // Cells written, starting at dp and going in range_dir
+    int32_t range_dir;          // +1 for '>' runs, -1 for '<' runs
+    int32_t range_move;         // Net dp change of the run
+    uint8_t range_fill;         // Value of every cell when range_values is NULL
+    uint8_t *range_values;      // Per-cell values in tape order
+} LoopInfo;
+
+
+// --- Trace Structures ---
+typedef struct {
+    uint8_t kind;
+    uint8_t value;              // TOP_ADD amount
+    int32_t offset;             // Cell relative to dp at the start of the iteration
+    uint32_t ref;               // TOP_LOOP/TOP_RANGE/TOP_CALL target
+    size_t ip;                  // Instruction to resume at on a side exit
+} TraceOp;
+
+// Op of a trace's cell-cached form (BFVM_ENGINE_CACHE_CELLS), which works on
+// the trace's cells packed into a 64-bit word instead of the tape
+typedef struct {
+    uint64_t add;               // TOP_ADD: the deltas of a run of ADDs, one byte per cell
+    uint8_t kind;
+    uint8_t shift;              // Bit position of the op's cell in the word
+    uint32_t source;            // Index of the TraceOp (offset, ip and ref)
+} CellOp;
+
+typedef struct {
+    TraceOp *ops;
+    size_t op_count;            // 0 while not (successfully) recorded
+    CellOp *cell_ops;
+    size_t cell_op_count;       // 0 when the trace has no cell-cached form
+    int32_t min_offset;         // Cells visited by one iteration, for a single bounds check
+    int32_t max_offset;
+    int32_t move;               // Net dp change per iteration
+    size_t open_ip;
+    size_t iterations;
+    size_t side_exits;
+    int recordings;
+} Trace;
+
+
+// --- Hang Detector Slot ---
+typedef struct {
+    size_t open_ip;             // SIZE_MAX when free
+    size_t dp;                  // dp at the back-edge (constant for balanced loops)
+    int32_t lo;                 // Window start relative to dp
+    int32_t width;
+    uint32_t since_sample;
+    uint64_t power;             // Brent: snapshot is re-taken after `power` samples
+    uint64_t lam;
+    uint32_t hash;
+    uint8_t snapshot[HANG_MAX_WINDOW];
+} HangSlot;
 
 
 // --- VM State Structure ---
@@ -49,21 +190,231 @@ typedef struct {
 
     // Optimization & Debugging related
     size_t *jump_table;         // Precomputed jump locations for []
+    uint32_t *loop_index;       // Per-ip index+1 into `loops` for analyzed '[' (0 = none)
+    LoopInfo *loops;            // Closed-form loop descriptors
+    size_t loop_count;
+    uint32_t *trace_index;      // Per-ip index+1 into `traces` for hot '[' (or TRACE_BLACKLISTED)
+    uint16_t *hotness;          // Per-ip back-edge counts
+    Trace *traces;
+    size_t trace_count;
+    size_t trace_capacity;
+    uint32_t *hang_window;      // Per-ip cached hang_window() result (0 = not computed)
+    HangSlot *hang_slots;
     debug_callback_t debug_hook; // Pointer to JS debug callback
     int single_step_mode;        // Flag for step-by-step debugging
+    int engine_flags;            // BFVM_ENGINE_* bits
+    cancel_poll_t cancel_poll;   // Optional JS hook, e.g. reading a SharedArrayBuffer flag
+    int32_t cancel_countdown;    // Back-edges until the next cancellation poll
+    int32_t poll_interval;       // Value cancel_countdown was last loaded with
+    uint64_t ops;                // Back-edges counted at earlier polls (see vm_ops)
+    uint64_t ops_limit;          // Pause with BFVM_PAUSED once ops reach this (0 = no limit)
+    uint64_t step_budget;        // Dispatches left (VARIANT_STEP)
+
+    // Watchpoints (VARIANT_WATCH): one bit per tape cell marks the cells watched
+    uint64_t *watch_bits;
+    const BfvmWatchpoint *watchpoints;
+    size_t watch_count;
+    BfvmWatchHit *watch_hit;
+
+    // Host I/O (instances): the buffers above are refilled/drained through io
+    const BfvmIO *io;
+    char *input_storage;         // Writable alias of input_buffer
+    size_t input_capacity;
+    uint64_t input_consumed;     // Bytes of earlier refills
+    uint64_t output_flushed;     // Bytes already passed to io->write
 
 } BrainfuckVM;
 
 
+// --- Per-Run Arena ---
+// Everything a run allocates (tape, jump table, loop and trace tables) comes
+// from one bump arena that is reset in O(1) when the run ends, so sustained
+// load doesn't churn malloc or fragment the Wasm heap. The arena is sized from
+// the previous run's high-water mark; requests that don't fit fall back to
+// malloc and make the next run's arena big enough. Outside of runs vm_alloc is
+// plain malloc (with the same size header), so tables that outlive a run
+// (bfvm_compile, instances) are freed the usual way. "malloc" here means the
+// allocator hooks.
+typedef struct {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    size_t last;                // Offset of the newest block (it can grow in place)
+    size_t requested;           // Bytes this run asked for, in the arena or not
+    size_t high_water;          // `requested` of the previous run
+    int active;
+} Arena;
+
+// One per thread, so runs on different threads (the Node addon's threadpool)
+// don't share it
+static _Thread_local Arena run_arena;
+
+// --- Allocator Hooks (bfvm_set_allocator) ---
+static void *default_alloc(void *user, size_t size) { (void)user; return malloc(size); }
+static void *default_realloc(void *user, void *ptr, size_t size) { (void)user; return realloc(ptr, size); }
+static void default_free(void *user, void *ptr) { (void)user; free(ptr); }
+
+static BfvmAllocator allocator = { default_alloc, default_realloc, default_free, NULL };
+
+EMSCRIPTEN_KEEPALIVE
+void bfvm_set_allocator(const BfvmAllocator *hooks) {
+    static const BfvmAllocator defaults = { default_alloc, default_realloc, default_free, NULL };
+    allocator = hooks && hooks->alloc && hooks->realloc && hooks->free ? *hooks : defaults;
+}
+
+static size_t arena_block_size(size_t size) {
+    return ARENA_HEADER + ((size + ARENA_HEADER - 1) & ~(size_t)(ARENA_HEADER - 1));
+}
+
+static int arena_owns(const void *ptr) {
+    return run_arena.base && (const uint8_t*)ptr >= run_arena.base &&
+           (const uint8_t*)ptr < run_arena.base + run_arena.size;
+}
+
+static void *vm_alloc(size_t size) {
+    size_t total = arena_block_size(size);
+    uint8_t *block;
+    if (total < size) return NULL; // Overflow
+    if (run_arena.active) {
+        run_arena.requested += total;
+        if (run_arena.size - run_arena.used >= total) {
+            block = run_arena.base + run_arena.used;
+            run_arena.last = run_arena.used;
+            run_arena.used += total;
+            *(size_t*)block = size;
+            return block + ARENA_HEADER;
+        }
+    }
+    block = (uint8_t*)allocator.alloc(allocator.user, total);
+    if (!block) return NULL;
+    *(size_t*)block = size;
+    return block + ARENA_HEADER;
+}
+
+static void *vm_calloc(size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void *ptr = vm_alloc(count * size);
+    if (ptr) memset(ptr, 0, count * size);
+    return ptr;
+}
+
+static void *vm_realloc(void *ptr, size_t size) {
+    if (!ptr) return vm_alloc(size);
+    uint8_t *block = (uint8_t*)ptr - ARENA_HEADER;
+    size_t old_size = *(size_t*)block;
+    size_t total = arena_block_size(size);
+    if (total < size) return NULL;
+
+    if (arena_owns(ptr)) {
+        if (block == run_arena.base + run_arena.last && run_arena.last + total <= run_arena.size) {
+            run_arena.requested += total - (run_arena.used - run_arena.last);
+            run_arena.used = run_arena.last + total;
+            *(size_t*)block = size;
+            return ptr;
+        }
+        void *moved = vm_alloc(size);
+        if (moved) memcpy(moved, ptr, old_size < size ? old_size : size);
+        return moved;
+    }
+    if (run_arena.active) run_arena.requested += total;
+    block = (uint8_t*)allocator.realloc(allocator.user, block, total);
+    if (!block) return NULL;
+    *(size_t*)block = size;
+    return block + ARENA_HEADER;
+}
+
+static void vm_free(void *ptr) {
+    if (!ptr || arena_owns(ptr)) return; // Arena blocks go away with the reset
+    allocator.free(allocator.user, (uint8_t*)ptr - ARENA_HEADER);
+}
+
+// Returns 1 if the caller owns the arena for this run. Runs nested in a debug
+// hook share the outer run's arena and leave the reset to it.
+static int arena_begin(void) {
+    if (run_arena.active) return 0;
+    size_t want = (run_arena.high_water + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+    if (want > run_arena.size || run_arena.size > ARENA_SHRINK_FACTOR * want) {
+        if (run_arena.base) allocator.free(allocator.user, run_arena.base);
+        run_arena.base = want ? (uint8_t*)allocator.alloc(allocator.user, want) : NULL;
+        run_arena.size = run_arena.base ? want : 0;
+    }
+    run_arena.used = 0;
+    run_arena.last = 0;
+    run_arena.requested = 0;
+    run_arena.active = 1;
+    return 1;
+}
+
+static void arena_end(int owned) {
+    if (!owned) return;
+    run_arena.active = 0;
+    run_arena.high_water = run_arena.requested;
+    run_arena.used = 0;
+}
+
+// For allocations that outlive the current run (compiled programs, instance
+// state), which may be made from a debug hook while a run is active.
+static int arena_suspend(void) {
+    int was_active = run_arena.active;
+    run_arena.active = 0;
+    return was_active;
+}
+
+static void arena_resume(int was_active) {
+    run_arena.active = was_active;
+}
+
+// Frees this thread's arena, for threads that are about to exit
+static void arena_release(void) {
+    if (run_arena.active) return;
+    if (run_arena.base) allocator.free(allocator.user, run_arena.base);
+    memset(&run_arena, 0, sizeof(Arena));
+}
+
+
+// --- Input/Output ---
+// Runs read input_buffer and fill output_buffer. Instances with host I/O
+// refill the input buffer when it runs dry and drain the output buffer when
+// it is full, so streams of any length pass through fixed-size buffers.
+static int refill_input(BrainfuckVM *vm) {
+    if (!vm->io || !vm->io->read) return 0;
+    vm->input_consumed += vm->input_ptr;
+    vm->input_ptr = 0;
+    vm->input_len = vm->io->read(vm->io->user, vm->input_storage, vm->input_capacity);
+    if (vm->input_len > vm->input_capacity) vm->input_len = vm->input_capacity;
+    return vm->input_len != 0;
+}
+
+// Next input byte, or 0 at EOF
+static inline uint8_t read_input(BrainfuckVM *vm) {
+    if ((vm->input_buffer && vm->input_ptr < vm->input_len) || refill_input(vm)) {
+        return (uint8_t)vm->input_buffer[vm->input_ptr++];
+    }
+    return 0;
+}
+
+// Passes the buffered output to the host: when the buffer is full, and when
+// an instance call returns (instances without a writer discard it).
+static int flush_output(BrainfuckVM *vm) {
+    if (!vm->io) return BF_ERR_OUTPUT_OVERFLOW; // One-shot runs: caller's fixed buffer
+    if (vm->io->write && vm->output_ptr && vm->io->write(vm->io->user, vm->output_buffer, vm->output_ptr)) {
+        return BF_ERR_OUTPUT_WRITE_FAILED;
+    }
+    vm->output_flushed += vm->output_ptr;
+    vm->output_ptr = 0;
+    return BF_SUCCESS;
+}
+
+
 // --- Optimization: Precompute Jump Table ---
 int build_jump_table(BrainfuckVM *vm) {
-    size_t *stack = (size_t*)malloc(MAX_BRACKET_DEPTH * sizeof(size_t));
+    size_t *stack = (size_t*)vm_alloc(MAX_BRACKET_DEPTH * sizeof(size_t));
     if (!stack) return BF_ERR_JUMPTABLE_ALLOC_FAILED; // Use a specific error maybe?
     int stack_ptr = -1; // Stack pointer
 
-    vm->jump_table = (size_t*)malloc(vm->code_len * sizeof(size_t));
+    vm->jump_table = (size_t*)vm_alloc(vm->code_len * sizeof(size_t));
     if (!vm->jump_table) {
-        free(stack);
+        vm_free(stack);
         return BF_ERR_JUMPTABLE_ALLOC_FAILED;
     }
     // Initialize jump table (optional, helps debugging)
@@ -72,16 +423,16 @@ int build_jump_table(BrainfuckVM *vm) {
     for (size_t i = 0; i < vm->code_len; ++i) {
         if (vm->code[i] == '[') {
             if (stack_ptr + 1 >= MAX_BRACKET_DEPTH) {
-                free(stack);
-                free(vm->jump_table); // Clean up allocated table
+                vm_free(stack);
+                vm_free(vm->jump_table); // Clean up allocated table
                 vm->jump_table = NULL;
                 return BF_ERR_STACK_OVERFLOW; // Too many nested brackets
             }
             stack[++stack_ptr] = i;
         } else if (vm->code[i] == ']') {
             if (stack_ptr < 0) {
-                free(stack);
-                free(vm->jump_table); // Clean up allocated table
+                vm_free(stack);
+                vm_free(vm->jump_table); // Clean up allocated table
                 vm->jump_table = NULL;
                 return BF_ERR_UNMATCHED_BRACKET_CLOSE; // Unmatched ']'
             }
@@ -91,10 +442,10 @@ int build_jump_table(BrainfuckVM *vm) {
         }
     }
 
-    free(stack);
+    vm_free(stack);
 
     if (stack_ptr != -1) {
-        free(vm->jump_table); // Clean up allocated table
+        vm_free(vm->jump_table); // Clean up allocated table
         vm->jump_table = NULL;
         return BF_ERR_UNMATCHED_BRACKET_OPEN; // Unmatched '[' left on stack
     }
@@ -103,178 +454,2296 @@ int build_jump_table(BrainfuckVM *vm) {
 }
 
 
-// --- Core Execution Function (Updated) ---
-EMSCRIPTEN_KEEPALIVE
-int bfvm_run(
-    const char* code_buf, size_t code_len,
-    const char* input_buf, size_t in_len,
-    char* out_buf, size_t out_len_max,
-    size_t requested_mem_size,
-    // Debugging arguments:
-    int debug_callback_ptr,     // Function pointer (as integer) from JS addFunction
-    int single_step           // Boolean flag (0 or 1) for single stepping
-) {
-    BrainfuckVM vm;
-    int result_code = BF_SUCCESS;
-    int debug_halt = 0; // Flag set by debug callback
+// --- Optimization: Loop Analysis ---
+// Inverse of an odd value modulo 256 (Newton iteration, 3 steps reach 8 bits).
+static uint8_t inverse_mod256(uint8_t odd) {
+    uint8_t x = odd; // Correct to 3 bits for any odd value
+    x *= (uint8_t)(2 - odd * x);
+    x *= (uint8_t)(2 - odd * x);
+    x *= (uint8_t)(2 - odd * x);
+    return x;
+}
 
-    // --- Validate Input Args ---
-    if (!code_buf || !out_buf || requested_mem_size == 0) {
-        return BF_ERR_INVALID_ARGS;
+// Records a cell delta at `offset`, returns 0 if the loop touches too many cells.
+static int loop_add_delta(LoopInfo *info, int32_t offset, uint8_t delta) {
+    for (int k = 0; k < info->cell_count; ++k) {
+        if (info->offsets[k] == offset) {
+            info->deltas[k] += delta;
+            return 1;
+        }
     }
+    if (info->cell_count >= MAX_LOOP_CELLS) return 0;
+    info->offsets[info->cell_count] = offset;
+    info->deltas[info->cell_count] = delta;
+    info->cell_count++;
+    return 1;
+}
 
-    // --- Initialize VM State ---
-    memset(&vm, 0, sizeof(BrainfuckVM));
-    vm.memory = NULL;
-    vm.jump_table = NULL; // Initialize jump table pointer
-    vm.debug_hook = (debug_callback_t)debug_callback_ptr; // Cast integer pointer back
-    vm.single_step_mode = single_step;
+// Classifies the loop [open_ip, close_ip]. Returns LOOP_KIND_NONE if it cannot
+// be run in closed form.
+static int analyze_linear_loop(const BrainfuckVM *vm, size_t open_ip, size_t close_ip, LoopInfo *info) {
+    int32_t offset = 0;
+    uint8_t step = 0;
 
-    // --- Allocate Memory Tape ---
-    vm.memory = (uint8_t*)malloc(requested_mem_size);
-    if (vm.memory == NULL) {
-        result_code = BF_ERR_TAPE_ALLOC_FAILED;
-        goto cleanup_and_exit; // Use goto for centralized cleanup
+    memset(info, 0, sizeof(LoopInfo));
+    for (size_t i = open_ip + 1; i < close_ip; ++i) {
+        switch (vm->code[i]) {
+            case '>': offset++; break;
+            case '<': offset--; break;
+            case '+':
+            case '-': {
+                uint8_t delta = vm->code[i] == '+' ? 1 : (uint8_t)-1;
+                if (offset == 0) {
+                    step += delta;
+                } else if (!loop_add_delta(info, offset, delta)) {
+                    return LOOP_KIND_NONE;
+                }
+                break;
+            }
+            case '.': case ',': case '[': case ']':
+                return LOOP_KIND_NONE; // Side effects or nested control flow
+        }
+        if (offset < info->min_offset) info->min_offset = offset;
+        if (offset > info->max_offset) info->max_offset = offset;
+    }
+    if (offset != 0 || step == 0) {
+        return LOOP_KIND_NONE; // Unbalanced, or counter never changes
     }
-    memset(vm.memory, 0, requested_mem_size);
-    vm.memory_size = requested_mem_size;
 
-    // --- Set up pointers and lengths ---
-    vm.dp = 0;
-    vm.ip = 0;
-    vm.input_ptr = 0;
-    vm.output_ptr = 0;
-    vm.code = code_buf;
-    vm.code_len = code_len;
-    vm.input_buffer = input_buf;
-    vm.input_len = in_len;
-    vm.output_buffer = out_buf;
-    vm.output_max_len = out_len_max;
+    // Drop cells whose deltas cancel out; they are left untouched
+    int kept = 0;
+    for (int k = 0; k < info->cell_count; ++k) {
+        if (info->deltas[k] != 0) {
+            info->offsets[kept] = info->offsets[k];
+            info->deltas[kept] = info->deltas[k];
+            kept++;
+        }
+    }
+    info->cell_count = kept;
 
-    // --- Precompute Jump Table ---
-    result_code = build_jump_table(&vm);
-    if (result_code != BF_SUCCESS) {
-        goto cleanup_and_exit; // Error during pre-scan
+    while ((step & 1) == 0) {
+        step >>= 1;
+        info->step_shift++;
     }
+    info->step_inv = inverse_mod256(step);
+    info->end_ip = close_ip;
+    info->kind = LOOP_KIND_LINEAR;
+    return info->kind;
+}
 
-    // --- Execution Loop ---
-    while (vm.ip < vm.code_len) {
+// Looks up (or adds) the row of `offset` in an AFFINE loop, -1 if out of rows.
+static int affine_cell(LoopInfo *info, int32_t offset) {
+    for (int k = 0; k < info->cell_count; ++k) {
+        if (info->offsets[k] == offset) return k;
+    }
+    if (info->cell_count >= MAX_LOOP_CELLS) return -1;
+    info->offsets[info->cell_count] = offset;
+    return info->cell_count++;
+}
 
-        // --- Debug Hook Call ---
-        if (vm.debug_hook && vm.single_step_mode) {
-            // Call JS callback before executing instruction
-             debug_halt = vm.debug_hook(vm.ip, vm.dp, vm.memory[vm.dp]);
-             if (debug_halt) {
-                result_code = BF_ERR_DEBUG_HALT_REQUESTED;
-                goto cleanup_and_exit;
-             }
+static void affine_multiply(uint8_t *dst, const uint8_t *a, const uint8_t *b, int dim) {
+    for (int r = 0; r < dim; ++r) {
+        for (int c = 0; c < dim; ++c) {
+            uint8_t sum = 0;
+            for (int k = 0; k < dim; ++k) sum += (uint8_t)(a[r * dim + k] * b[k * dim + c]);
+            dst[r * dim + c] = sum;
         }
-        // TODO: Add breakpoint checking here if not using only single_step
-        // It would involve passing a breakpoint array pointer and size, allocating
-        // it in JS, and checking if vm.ip is in that array.
+    }
+}
 
-        char command = vm.code[vm.ip];
-        size_t count = 1; // For instruction folding
+// Classifies a loop whose body nests LINEAR loops (e.g. multiplication
+// [>[->+>+<<]>[-<+>]<<-]). Each iteration is tracked symbolically as an affine
+// map of the cells at loop entry; inner trip counts are -value*inv(step), which
+// is linear as long as the inner step is odd. The outer counter may only be
+// changed by constants so the outer trip count stays computable.
+static int analyze_affine_loop(const BrainfuckVM *vm, size_t open_ip, size_t close_ip, LoopInfo *info) {
+    const int C = AFFINE_DIM - 1; // Constant column
+    uint8_t m[AFFINE_DIM][AFFINE_DIM];
+    int32_t offset = 0;
+    int has_inner = 0;
+
+    memset(info, 0, sizeof(LoopInfo));
+    memset(m, 0, sizeof(m));
+    for (int k = 0; k < AFFINE_DIM; ++k) m[k][k] = 1;
+    affine_cell(info, 0); // Row 0: counter
+
+    for (size_t i = open_ip + 1; i < close_ip; ++i) {
+        switch (vm->code[i]) {
+            case '>': offset++; break;
+            case '<': offset--; break;
+            case '+':
+            case '-': {
+                int r = affine_cell(info, offset);
+                if (r < 0) return LOOP_KIND_NONE;
+                m[r][C] += vm->code[i] == '+' ? 1 : (uint8_t)-1;
+                break;
+            }
+            case '[': {
+                uint32_t idx = vm->loop_index[i];
+                if (!idx) return LOOP_KIND_NONE;
+                const LoopInfo *inner = &vm->loops[idx - 1];
+                if (inner->kind != LOOP_KIND_LINEAR || inner->step_shift != 0) return LOOP_KIND_NONE;
+
+                int r = affine_cell(info, offset);
+                if (r < 0) return LOOP_KIND_NONE;
+                uint8_t trips[AFFINE_DIM];
+                for (int j = 0; j < AFFINE_DIM; ++j) trips[j] = (uint8_t)(-(inner->step_inv * m[r][j]));
+                for (int c = 0; c < inner->cell_count; ++c) {
+                    int rc = affine_cell(info, offset + inner->offsets[c]);
+                    if (rc < 0) return LOOP_KIND_NONE;
+                    for (int j = 0; j < AFFINE_DIM; ++j) m[rc][j] += (uint8_t)(inner->deltas[c] * trips[j]);
+                }
+                memset(m[r], 0, sizeof(m[r])); // Inner counter always ends at zero
+
+                if (offset + inner->min_offset < info->min_offset) info->min_offset = offset + inner->min_offset;
+                if (offset + inner->max_offset > info->max_offset) info->max_offset = offset + inner->max_offset;
+                i = inner->end_ip;
+                has_inner = 1;
+                break;
+            }
+            case '.': case ',': case ']':
+                return LOOP_KIND_NONE;
+        }
+        if (offset < info->min_offset) info->min_offset = offset;
+        if (offset > info->max_offset) info->max_offset = offset;
+    }
+    if (offset != 0 || !has_inner) {
+        return LOOP_KIND_NONE; // Unbalanced, or already LINEAR
+    }
+
+    // The counter row must be x0' = x0 + step
+    uint8_t step = m[0][C];
+    if (m[0][0] != 1 || step == 0) return LOOP_KIND_NONE;
+    for (int j = 1; j < info->cell_count; ++j) {
+        if (m[0][j] != 0) return LOOP_KIND_NONE;
+    }
+
+    // Compact to (cell_count+1)^2 and precompute the squarings
+    int dim = info->cell_count + 1;
+    info->powers = (uint8_t*)vm_alloc((size_t)AFFINE_POWERS * dim * dim);
+    if (!info->powers) return LOOP_KIND_NONE;
+    for (int r = 0; r < dim; ++r) {
+        for (int c = 0; c < dim; ++c) {
+            int mc = c < dim - 1 ? c : C;
+            info->powers[r * dim + c] = r < dim - 1 ? m[r][mc] : (uint8_t)(c == dim - 1);
+        }
+    }
+    for (int p = 1; p < AFFINE_POWERS; ++p) {
+        const uint8_t *prev = info->powers + (size_t)(p - 1) * dim * dim;
+        affine_multiply(info->powers + (size_t)p * dim * dim, prev, prev, dim);
+    }
+
+    while ((step & 1) == 0) {
+        step >>= 1;
+        info->step_shift++;
+    }
+    info->step_inv = inverse_mod256(step);
+    info->end_ip = close_ip;
+    info->kind = LOOP_KIND_AFFINE;
+    return info->kind;
+}
+
+// Appends a descriptor and points the '[' at `open_ip` to it.
+static int push_loop(BrainfuckVM *vm, size_t *capacity, size_t open_ip, const LoopInfo *info) {
+    if (vm->loop_count == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        LoopInfo *grown = (LoopInfo*)vm_realloc(vm->loops, new_capacity * sizeof(LoopInfo));
+        if (!grown) return 0;
+        vm->loops = grown;
+        *capacity = new_capacity;
+    }
+    vm->loops[vm->loop_count++] = *info;
+    vm->loop_index[open_ip] = (uint32_t)vm->loop_count;
+    return 1;
+}
+
+// A LINEAR loop without other cells and with an odd step always ends with its
+// cell at zero, whatever the starting value ([-], [+], [---], ...).
+static const LoopInfo *clear_loop_at(const BrainfuckVM *vm, size_t ip) {
+    if (ip >= vm->code_len || vm->code[ip] != '[' || !vm->loop_index[ip]) return NULL;
+    const LoopInfo *info = &vm->loops[vm->loop_index[ip] - 1];
+    if (info->kind != LOOP_KIND_LINEAR || info->cell_count != 0 || info->step_shift != 0) return NULL;
+    return info;
+}
+
+// Collects the run of clear/set units starting at `open_ip`: each unit is a
+// clear loop, an optional +/- run (the value set) and one move, all moves in
+// the same direction. Returns LOOP_KIND_NONE for runs of fewer than 2 units.
+static int analyze_clear_range(const BrainfuckVM *vm, size_t open_ip, LoopInfo *info) {
+    uint8_t values[256];
+    size_t len = 0;
+    size_t ip = open_ip;
+    int32_t dir = 0;
+    int32_t move = 0;
+    const LoopInfo *unit;
+
+    memset(info, 0, sizeof(LoopInfo));
+    while ((unit = clear_loop_at(vm, ip)) != NULL && len < sizeof(values)) {
+        if (len == 0) {
+            info->end_ip = unit->end_ip;
+            info->range_first = vm->loop_index[ip];
+        }
+        // The unit's body may wander further than its own cell before clearing it
+        if (move + unit->min_offset < info->min_offset) info->min_offset = move + unit->min_offset;
+        if (move + unit->max_offset > info->max_offset) info->max_offset = move + unit->max_offset;
+        uint8_t value = 0;
+        ip = unit->end_ip + 1;
+        while (ip < vm->code_len && (vm->code[ip] == '+' || vm->code[ip] == '-')) {
+            value += vm->code[ip] == '+' ? 1 : (uint8_t)-1;
+            ip++;
+        }
+        values[len++] = value;
+        info->range_end_ip = ip - 1;
+
+        int32_t unit_dir = ip < vm->code_len ? (vm->code[ip] == '>' ? 1 : vm->code[ip] == '<' ? -1 : 0) : 0;
+        if (unit_dir == 0 || (dir != 0 && unit_dir != dir)) break;
+        dir = unit_dir;
+        move += dir;
+        info->range_end_ip = ip;
+        ip++;
+    }
+    if (len < 2) return LOOP_KIND_NONE;
+
+    info->range_len = len;
+    info->range_dir = dir;
+    info->range_move = move;
+    if (move < info->min_offset) info->min_offset = move;
+    if (move > info->max_offset) info->max_offset = move;
+
+    info->range_fill = values[0];
+    for (size_t k = 1; k < len; ++k) {
+        if (values[k] != values[0]) {
+            info->range_values = (uint8_t*)vm_alloc(len);
+            if (!info->range_values) return LOOP_KIND_NONE;
+            for (size_t j = 0; j < len; ++j) {
+                info->range_values[j] = dir > 0 ? values[j] : values[len - 1 - j];
+            }
+            break;
+        }
+    }
+    info->kind = LOOP_KIND_CLEAR_RANGE;
+    return info->kind;
+}
+
+// Builds the per-ip loop index. Loops are visited at their ']' so inner loops
+// are classified before the loops containing them; clear runs are merged in a
+// second pass. Analysis is best-effort: on allocation failure the tables stay
+// NULL or partial and the remaining loops are simply interpreted.
+void analyze_loops(BrainfuckVM *vm) {
+    size_t capacity = 0;
+    LoopInfo info;
+
+    vm->loop_index = (uint32_t*)vm_calloc(vm->code_len ? vm->code_len : 1, sizeof(uint32_t));
+    if (!vm->loop_index) return;
+
+    for (size_t i = 0; i < vm->code_len; ++i) {
+        if (vm->code[i] != ']') continue;
+        size_t open_ip = vm->jump_table[i];
+        if (analyze_linear_loop(vm, open_ip, i, &info) == LOOP_KIND_NONE &&
+            analyze_affine_loop(vm, open_ip, i, &info) == LOOP_KIND_NONE) {
+            continue;
+        }
+        if (!push_loop(vm, &capacity, open_ip, &info)) {
+            vm_free(info.powers);
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < vm->code_len; ++i) {
+        if (analyze_clear_range(vm, i, &info) == LOOP_KIND_NONE) continue;
+        if (!push_loop(vm, &capacity, i, &info)) {
+            vm_free(info.range_values);
+            return;
+        }
+        i = info.range_end_ip; // Units inside the run keep their own clear entries
+    }
+}
+
+void free_loops(BrainfuckVM *vm) {
+    for (size_t k = 0; k < vm->loop_count; ++k) {
+        vm_free(vm->loops[k].powers);
+        vm_free(vm->loops[k].range_values);
+    }
+    vm_free(vm->loops);
+    vm_free(vm->loop_index);
+    vm->loops = NULL;
+    vm->loop_index = NULL;
+    vm->loop_count = 0;
+}
+
+// Computes the trip count of an analyzed loop from its counter value. Returns 0
+// if the count cannot be derived or a touched cell lies outside the tape; the
+// caller then interprets the loop normally.
+static int loop_trip_count(const BrainfuckVM *vm, const LoopInfo *info, uint8_t *trips) {
+    uint8_t value = vm->memory[vm->dp];
+    uint8_t low_mask = (uint8_t)((1u << info->step_shift) - 1);
+
+    if (value & low_mask) {
+        return 0; // Even step that never lands on zero: loop never terminates
+    }
+    if ((info->min_offset < 0 && vm->dp < (size_t)-info->min_offset) ||
+        vm->dp + (size_t)info->max_offset >= vm->memory_size) {
+        return 0;
+    }
+
+    // Smallest t with value + t*step == 0 (mod 256)
+    *trips = (uint8_t)((uint8_t)(((uint8_t)-value) >> info->step_shift) * info->step_inv);
+    if (info->step_shift) *trips &= (uint8_t)(0xFF >> info->step_shift);
+    return 1;
+}
+
+// Applies a LINEAR loop in one step.
+static int run_linear_loop(BrainfuckVM *vm, const LoopInfo *info) {
+    uint8_t trips;
+    if (!loop_trip_count(vm, info, &trips)) return 0;
+
+    for (int k = 0; k < info->cell_count; ++k) {
+        vm->memory[vm->dp + info->offsets[k]] += (uint8_t)(info->deltas[k] * trips);
+    }
+    vm->memory[vm->dp] = 0;
+    return 1;
+}
+
+// Applies an AFFINE loop as x = M^trips * x, one squaring per set bit.
+static int run_affine_loop(BrainfuckVM *vm, const LoopInfo *info) {
+    uint8_t trips;
+    if (!loop_trip_count(vm, info, &trips)) return 0;
+
+    int dim = info->cell_count + 1;
+    uint8_t x[AFFINE_DIM], y[AFFINE_DIM];
+    for (int k = 0; k < info->cell_count; ++k) x[k] = vm->memory[vm->dp + info->offsets[k]];
+    x[dim - 1] = 1;
+
+    for (int p = 0; p < AFFINE_POWERS; ++p) {
+        if (!(trips & (1u << p))) continue;
+        const uint8_t *mat = info->powers + (size_t)p * dim * dim;
+        for (int r = 0; r < dim - 1; ++r) {
+            uint8_t sum = 0;
+            for (int c = 0; c < dim; ++c) sum += (uint8_t)(mat[r * dim + c] * x[c]);
+            y[r] = sum;
+        }
+        memcpy(x, y, (size_t)(dim - 1));
+    }
+
+    for (int k = 0; k < info->cell_count; ++k) vm->memory[vm->dp + info->offsets[k]] = x[k];
+    return 1;
+}
+
+// Writes a whole CLEAR_RANGE with one bounds check and a memset/memcpy.
+// Returns 0 if the run would leave the tape; the caller then interprets it.
+static int run_clear_range(BrainfuckVM *vm, const LoopInfo *info) {
+    if ((info->min_offset < 0 && vm->dp < (size_t)-info->min_offset) ||
+        vm->dp + (size_t)info->max_offset >= vm->memory_size) {
+        return 0;
+    }
+    uint8_t *start = vm->memory + vm->dp - (info->range_dir > 0 ? 0 : info->range_len - 1);
+    if (info->range_values) {
+        memcpy(start, info->range_values, info->range_len);
+    } else {
+        memset(start, info->range_fill, info->range_len);
+    }
+    vm->dp += (size_t)(ptrdiff_t)info->range_move;
+    return 1;
+}
+
+static int run_closed_form_loop(BrainfuckVM *vm, const LoopInfo *info) {
+    switch (info->kind) {
+        case LOOP_KIND_AFFINE: return run_affine_loop(vm, info);
+        case LOOP_KIND_CLEAR_RANGE: return run_linear_loop(vm, &vm->loops[info->range_first - 1]);
+        default: return run_linear_loop(vm, info);
+    }
+}
+
+
+// --- Trace Tier ---
+// Hot loops (by back-edge count) get one iteration recorded as it actually
+// runs: pointer moves are folded into cell offsets, every bracket decision
+// becomes a guard and closed-form loops become single ops. The trace then
+// replays whole iterations as straight-line code. Anything unexpected (a guard
+// failing, the tape or output edge, a closed-form loop declining) side-exits
+// to the interpreter at the exact instruction, so the trace never raises
+// errors itself.
+static void free_traces(BrainfuckVM *vm) {
+    for (size_t k = 0; k < vm->trace_count; ++k) {
+        vm_free(vm->traces[k].ops);
+        vm_free(vm->traces[k].cell_ops);
+    }
+    vm_free(vm->traces);
+    vm_free(vm->trace_index);
+    vm_free(vm->hotness);
+    vm->traces = NULL;
+    vm->trace_index = NULL;
+    vm->hotness = NULL;
+    vm->trace_count = 0;
+}
+
+// Allocates the per-ip trace tables. Best-effort like loop analysis: without
+// them the trace tier simply stays off.
+static void init_traces(BrainfuckVM *vm) {
+    size_t n = vm->code_len ? vm->code_len : 1;
+    vm->trace_index = (uint32_t*)vm_calloc(n, sizeof(uint32_t));
+    vm->hotness = (uint16_t*)vm_calloc(n, sizeof(uint16_t));
+    if (!vm->trace_index || !vm->hotness) free_traces(vm);
+}
+
+static int trace_push(Trace *trace, uint8_t kind, int32_t offset, size_t ip) {
+    if (trace->op_count >= TRACE_MAX_OPS) return 0;
+    TraceOp *op = &trace->ops[trace->op_count++];
+    op->kind = kind;
+    op->value = 0;
+    op->offset = offset;
+    op->ref = 0;
+    op->ip = ip;
+    return 1;
+}
+
+static int32_t trace_offset(const BrainfuckVM *vm, size_t base) {
+    return (int32_t)((ptrdiff_t)vm->dp - (ptrdiff_t)base);
+}
+
+static void trace_track(Trace *trace, int32_t offset) {
+    if (offset < trace->min_offset) trace->min_offset = offset;
+    if (offset > trace->max_offset) trace->max_offset = offset;
+}
+
+static int enter_trace(BrainfuckVM *vm, Trace *trace);
+
+// Executes one iteration of the loop at `open_ip` (cell known non-zero)
+// exactly like the interpreter would, recording it into `trace`. Returns 1 if
+// the iteration reached the loop's ']', 0 if recording gave up; either way
+// vm->ip/dp describe where the interpreter resumes (ip - 1 convention).
+static int record_trace(BrainfuckVM *vm, size_t open_ip, Trace *trace) {
+    size_t close_ip = vm->jump_table[open_ip];
+    size_t base = vm->dp;
+    size_t ip = open_ip + 1;
+
+    trace->op_count = 0;
+    trace->min_offset = 0;
+    trace->max_offset = 0;
+
+    size_t start = ip;
+    while (ip < close_ip) {
+        char command = vm->code[ip];
+        size_t count = 1;
+        start = ip;
+        int32_t offset = trace_offset(vm, base);
 
         switch (command) {
             case '>':
             case '<':
-                 // Instruction Folding
-                while (vm.ip + 1 < vm.code_len && vm.code[vm.ip + 1] == command) {
-                    count++;
-                    vm.ip++;
-                }
-                if (command == '>') {
-                    if (vm.dp + count >= vm.memory_size) {
-                        result_code = BF_ERR_MEMORY_OUT_OF_BOUNDS; goto cleanup_and_exit;
-                    }
-                    vm.dp += count;
-                } else { // command == '<'
-                    if (vm.dp < count) { // Check for underflow before subtraction
-                         result_code = BF_ERR_MEMORY_OUT_OF_BOUNDS; goto cleanup_and_exit;
-                    }
-                    vm.dp -= count;
+                while (ip + 1 < close_ip && vm->code[ip + 1] == command) { count++; ip++; }
+                if (command == '>' ? vm->dp + count >= vm->memory_size : vm->dp < count) {
+                    goto abort; // Let the interpreter raise the error
                 }
+                vm->dp = command == '>' ? vm->dp + count : vm->dp - count;
+                trace_track(trace, trace_offset(vm, base));
                 break;
             case '+':
-            case '-':
-                 // Instruction Folding
-                while (vm.ip + 1 < vm.code_len && vm.code[vm.ip + 1] == command) {
-                    count++;
-                    vm.ip++;
-                }
-                if (command == '+') {
-                    vm.memory[vm.dp] += count; // Let uint8_t wrap naturally
-                } else { // command == '-'
-                    vm.memory[vm.dp] -= count; // Let uint8_t wrap naturally
+            case '-': {
+                while (ip + 1 < close_ip && vm->code[ip + 1] == command) { count++; ip++; }
+                uint8_t delta = (uint8_t)(command == '+' ? count : -count);
+                TraceOp *last = trace->op_count ? &trace->ops[trace->op_count - 1] : NULL;
+                if (last && last->kind == TOP_ADD && last->offset == offset) {
+                    last->value += delta;
+                } else {
+                    if (!trace_push(trace, TOP_ADD, offset, start)) goto abort;
+                    trace->ops[trace->op_count - 1].value = delta;
                 }
+                vm->memory[vm->dp] += delta;
                 break;
+            }
             case '.':
-                if (vm.output_ptr >= vm.output_max_len) {
-                    result_code = BF_ERR_OUTPUT_OVERFLOW; goto cleanup_and_exit;
-                }
-                vm.output_buffer[vm.output_ptr++] = vm.memory[vm.dp];
+                if (vm->output_ptr >= vm->output_max_len) goto abort;
+                if (!trace_push(trace, TOP_OUT, offset, start)) goto abort;
+                vm->output_buffer[vm->output_ptr++] = vm->memory[vm->dp];
                 break;
             case ',':
-                if (vm.input_buffer && vm.input_ptr < vm.input_len) {
-                    vm.memory[vm.dp] = vm.input_buffer[vm.input_ptr++];
+                if (!trace_push(trace, TOP_IN, offset, start)) goto abort;
+                vm->memory[vm->dp] = read_input(vm);
+                break;
+            case '[': {
+                const LoopInfo *info = vm->loop_index && vm->loop_index[ip] ? &vm->loops[vm->loop_index[ip] - 1] : NULL;
+                uint32_t inner = vm->trace_index[ip];
+                if (info && info->kind == LOOP_KIND_CLEAR_RANGE && trace->op_count < TRACE_MAX_OPS &&
+                    run_clear_range(vm, info)) {
+                    trace_push(trace, TOP_RANGE, offset, start);
+                    trace->ops[trace->op_count - 1].ref = vm->loop_index[ip];
+                    trace_track(trace, trace_offset(vm, base));
+                    ip = info->range_end_ip;
+                } else if (vm->memory[vm->dp] == 0) {
+                    if (!trace_push(trace, TOP_GUARD_ZERO, offset, start)) goto abort;
+                    ip = vm->jump_table[ip];
+                } else if (info && trace->op_count < TRACE_MAX_OPS && run_closed_form_loop(vm, info)) {
+                    trace_push(trace, TOP_LOOP, offset, start);
+                    trace->ops[trace->op_count - 1].ref = vm->loop_index[ip];
+                    ip = info->end_ip;
+                } else if (inner && inner != TRACE_BLACKLISTED && vm->traces[inner - 1].op_count &&
+                           vm->traces[inner - 1].move == 0) {
+                    // Balanced inner loop with its own trace: call it
+                    if (!trace_push(trace, TOP_CALL, offset, start)) goto abort;
+                    trace->ops[trace->op_count - 1].ref = inner;
+                    if (!enter_trace(vm, &vm->traces[inner - 1])) return 0; // Side exit already placed ip/dp
+                    ip = vm->ip;
                 } else {
-                    vm.memory[vm.dp] = 0; // EOF convention
+                    if (!trace_push(trace, TOP_GUARD_NONZERO, offset, start)) goto abort;
                 }
                 break;
-            case '[':
-                if (vm.memory[vm.dp] == 0) {
-                    // Jump using precomputed table
-                    vm.ip = vm.jump_table[vm.ip];
-                }
-                // Basic optimization for [-] / [+] loops (clear current cell)
-                else if (vm.ip + 2 < vm.code_len &&
-                         (vm.code[vm.ip + 1] == '-' || vm.code[vm.ip + 1] == '+') &&
-                         vm.code[vm.ip + 2] == ']')
-                {
-                    vm.memory[vm.dp] = 0;
-                    vm.ip += 2; // Skip over the '-' and ']'
-                     // Debug hook after optimization if stepping
-                    if (vm.debug_hook && vm.single_step_mode) {
-                        debug_halt = vm.debug_hook(vm.ip, vm.dp, vm.memory[vm.dp]);
-                        if (debug_halt) { result_code = BF_ERR_DEBUG_HALT_REQUESTED; goto cleanup_and_exit; }
-                    }
+            }
+            case ']':
+                if (vm->memory[vm->dp] != 0) {
+                    if (!trace_push(trace, TOP_GUARD_NONZERO, offset, start)) goto abort;
+                    ip = vm->jump_table[ip];
+                } else {
+                    if (!trace_push(trace, TOP_GUARD_ZERO, offset, start)) goto abort;
                 }
                 break;
-            case ']':
-                 if (vm.memory[vm.dp] != 0) {
-                     // Jump using precomputed table
-                     vm.ip = vm.jump_table[vm.ip];
-                 }
-                 break;
-            // Ignore other characters (comments)
         }
-        vm.ip++; // Move to the next instruction
+        ip++;
     }
 
-    // --- Normal Exit ---
-    if (vm.output_ptr < vm.output_max_len) {
-         vm.output_buffer[vm.output_ptr] = '\0';
-    }
-    // Only set success code if no error/halt occurred
-    if (result_code == BF_SUCCESS) {
-        result_code = (int)vm.output_ptr; // Success: return bytes written
-    }
+    trace->move = trace_offset(vm, base);
+    vm->ip = close_ip - 1; // Interpreter evaluates the ']' and enters the trace
+    return 1;
 
+abort:
+    vm->ip = start - 1; // Nothing of this instruction has run yet
+    return 0;
+}
 
-cleanup_and_exit:
-    // --- Free Dynamically Allocated Memory ---
-    if (vm.memory != NULL) {
-        free(vm.memory);
+// Leaves a trace between two iterations (ip - 1 convention: the next one is
+// interpreted) so the interpreter's back-edge gets to poll for cancellation.
+static int trace_yield(BrainfuckVM *vm, const Trace *trace, size_t base) {
+    vm->dp = base;
+    vm->ip = trace->open_ip;
+    return 0;
+}
+
+// Replays `trace` while its loop keeps iterating. Returns 1 when the loop
+// exits normally (ip at its ']'), 0 on a side exit (ip/dp at the instruction
+// to resume, ip - 1 convention).
+static int run_trace(BrainfuckVM *vm, Trace *trace) {
+    uint8_t *memory = vm->memory;
+
+    for (;;) {
+        size_t base = vm->dp;
+        if ((trace->min_offset < 0 && base < (size_t)-trace->min_offset) ||
+            base + (size_t)trace->max_offset >= vm->memory_size) {
+            vm->ip = trace->open_ip; // Interpret this iteration
+            trace->side_exits++;
+            return 0;
+        }
+
+        const TraceOp *op = trace->ops;
+        const TraceOp *end = trace->ops + trace->op_count;
+        for (; op < end; ++op) {
+            uint8_t *cell = memory + base + op->offset;
+            switch (op->kind) {
+                case TOP_ADD:
+                    *cell += op->value;
+                    break;
+                case TOP_OUT:
+                    if (vm->output_ptr >= vm->output_max_len) goto side_exit;
+                    vm->output_buffer[vm->output_ptr++] = *cell;
+                    break;
+                case TOP_IN:
+                    *cell = read_input(vm);
+                    break;
+                case TOP_GUARD_ZERO:
+                    if (*cell != 0) goto side_exit;
+                    break;
+                case TOP_GUARD_NONZERO:
+                    if (*cell == 0) goto side_exit;
+                    break;
+                case TOP_LOOP:
+                    vm->dp = base + op->offset;
+                    if (!run_closed_form_loop(vm, &vm->loops[op->ref - 1])) goto side_exit;
+                    break;
+                case TOP_RANGE:
+                    vm->dp = base + op->offset;
+                    if (!run_clear_range(vm, &vm->loops[op->ref - 1])) goto side_exit;
+                    break;
+                case TOP_CALL: {
+                    Trace *inner = &vm->traces[op->ref - 1];
+                    if (*cell == 0) break;
+                    if (!inner->op_count || inner->move != 0) goto side_exit; // Re-recorded since
+                    vm->dp = base + op->offset;
+                    if (!enter_trace(vm, inner)) {
+                        if (vm->cancel_countdown > 0) trace->side_exits++; // Not for a yield
+                        return 0;
+                    }
+                    break;
+                }
+            }
+        }
+
+        vm->dp = base + trace->move;
+        trace->iterations++;
+        if (memory[vm->dp] == 0) {
+            vm->ip = vm->jump_table[trace->open_ip];
+            return 1;
+        }
+        if (--vm->cancel_countdown <= 0) return trace_yield(vm, trace, vm->dp);
+        continue;
+
+    side_exit:
+        vm->dp = base + op->offset;
+        vm->ip = op->ip - 1;
+        trace->side_exits++;
+        return 0;
+    }
+}
+
+// --- Cell-Cached Traces (BFVM_ENGINE_CACHE_CELLS) ---
+// A balanced trace works on the same cells every iteration. When they fit in
+// TRACE_CELL_WINDOW consecutive cells, that window is loaded into one 64-bit
+// word (a machine register, or an i64 local in Wasm) when the loop is
+// entered and stored back only when it exits, side-exits or yields, and
+// around ops that work on the tape itself (closed-form loops, clear runs,
+// inner traces). A run of ADDs becomes one carry-free add of their packed
+// deltas, guards and '.' read a byte of the word and ',' replaces one.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CELL_SHIFT(cell) (8 * (TRACE_CELL_WINDOW - 1 - (cell)))
+#else
+#define CELL_SHIFT(cell) (8 * (cell))
+#endif
+
+// Bytewise add without carries from one cell into the next
+static inline uint64_t cells_add(uint64_t cells, uint64_t deltas) {
+    const uint64_t high = 0x8080808080808080ull;
+    return ((cells & ~high) + (deltas & ~high)) ^ ((cells ^ deltas) & high);
+}
+
+static inline uint64_t cells_load(const uint8_t *window) {
+    uint64_t cells;
+    memcpy(&cells, window, sizeof(cells));
+    return cells;
+}
+
+static inline void cells_store(uint8_t *window, uint64_t cells) {
+    memcpy(window, &cells, sizeof(cells));
+}
+
+// Builds the cell-cached form of a freshly recorded trace. Traces that move
+// or span more cells than the window keep plain replay.
+static void compile_trace_cells(Trace *trace) {
+    trace->cell_op_count = 0;
+    if (trace->move != 0 || trace->max_offset - trace->min_offset >= TRACE_CELL_WINDOW) return;
+    if (!trace->cell_ops) {
+        trace->cell_ops = (CellOp*)vm_alloc(TRACE_MAX_OPS * sizeof(CellOp));
+        if (!trace->cell_ops) return;
+    }
+
+    size_t count = 0;
+    for (size_t k = 0; k < trace->op_count; ++k) {
+        const TraceOp *op = &trace->ops[k];
+        uint8_t shift = (uint8_t)CELL_SHIFT(op->offset - trace->min_offset);
+        if (op->kind == TOP_ADD && count && trace->cell_ops[count - 1].kind == TOP_ADD) {
+            CellOp *run = &trace->cell_ops[count - 1];
+            run->add = cells_add(run->add, (uint64_t)op->value << shift);
+            continue;
+        }
+        CellOp *cell_op = &trace->cell_ops[count++];
+        cell_op->kind = op->kind;
+        cell_op->shift = shift;
+        cell_op->source = (uint32_t)k;
+        cell_op->add = op->kind == TOP_ADD ? (uint64_t)op->value << shift : 0;
+    }
+    trace->cell_op_count = count;
+}
+
+// run_trace on the cell-cached form; same results and exits
+static int run_trace_cells(BrainfuckVM *vm, Trace *trace) {
+    size_t base = vm->dp;
+    int32_t lo = trace->min_offset;
+    // The window may reach past the trace's cells, but not past the tape
+    if ((lo < 0 && base < (size_t)-lo) || base + (size_t)(ptrdiff_t)lo + TRACE_CELL_WINDOW > vm->memory_size) {
+        return run_trace(vm, trace);
+    }
+
+    uint8_t *window = vm->memory + base + lo;
+    const unsigned exit_shift = CELL_SHIFT(-lo);
+    const CellOp *end = trace->cell_ops + trace->cell_op_count;
+    const CellOp *op;
+    uint64_t cells = cells_load(window);
+
+    for (;;) {
+        for (op = trace->cell_ops; op < end; ++op) {
+            switch (op->kind) {
+                case TOP_ADD:
+                    cells = cells_add(cells, op->add);
+                    break;
+                case TOP_OUT:
+                    if (vm->output_ptr >= vm->output_max_len) goto side_exit;
+                    vm->output_buffer[vm->output_ptr++] = (char)(cells >> op->shift);
+                    break;
+                case TOP_IN:
+                    cells = (cells & ~((uint64_t)0xFF << op->shift)) | (uint64_t)read_input(vm) << op->shift;
+                    break;
+                case TOP_GUARD_ZERO:
+                    if ((uint8_t)(cells >> op->shift) != 0) goto side_exit;
+                    break;
+                case TOP_GUARD_NONZERO:
+                    if ((uint8_t)(cells >> op->shift) == 0) goto side_exit;
+                    break;
+                case TOP_LOOP:
+                case TOP_RANGE: {
+                    const TraceOp *source = &trace->ops[op->source];
+                    const LoopInfo *info = &vm->loops[source->ref - 1];
+                    cells_store(window, cells);
+                    vm->dp = base + source->offset;
+                    if (!(op->kind == TOP_LOOP ? run_closed_form_loop(vm, info) : run_clear_range(vm, info))) {
+                        goto side_exit;
+                    }
+                    cells = cells_load(window);
+                    break;
+                }
+                case TOP_CALL: {
+                    const TraceOp *source = &trace->ops[op->source];
+                    Trace *inner = &vm->traces[source->ref - 1];
+                    if ((uint8_t)(cells >> op->shift) == 0) break;
+                    if (!inner->op_count || inner->move != 0) goto side_exit; // Re-recorded since
+                    cells_store(window, cells);
+                    vm->dp = base + source->offset;
+                    if (!enter_trace(vm, inner)) {
+                        if (vm->cancel_countdown > 0) trace->side_exits++; // Not for a yield
+                        return 0;
+                    }
+                    cells = cells_load(window);
+                    break;
+                }
+            }
+        }
+
+        trace->iterations++;
+        if ((uint8_t)(cells >> exit_shift) == 0) {
+            cells_store(window, cells);
+            vm->dp = base;
+            vm->ip = vm->jump_table[trace->open_ip];
+            return 1;
+        }
+        if (--vm->cancel_countdown <= 0) {
+            cells_store(window, cells);
+            return trace_yield(vm, trace, base);
+        }
+    }
+
+side_exit:
+    cells_store(window, cells);
+    vm->dp = base + trace->ops[op->source].offset;
+    vm->ip = trace->ops[op->source].ip - 1;
+    trace->side_exits++;
+    return 0;
+}
+
+static int enter_trace(BrainfuckVM *vm, Trace *trace) {
+    return trace->cell_op_count ? run_trace_cells(vm, trace) : run_trace(vm, trace);
+}
+
+// Called by the interpreter on a taken back-edge (vm->ip at the loop's '[').
+// Counts hotness, records the loop once it is hot and runs its trace; on return
+// vm->ip/dp are set so the interpreter's ip++ resumes at the right place.
+static void trace_back_edge(BrainfuckVM *vm) {
+    size_t open_ip = vm->ip;
+    uint32_t slot = vm->trace_index[open_ip];
+
+    if (slot == TRACE_BLACKLISTED) return;
+    if (slot) {
+        Trace *trace = &vm->traces[slot - 1];
+        if (trace->op_count) {
+            enter_trace(vm, trace);
+            // Traces that keep side-exiting are thrown away and re-recorded
+            if (trace->side_exits > TRACE_MAX_SIDE_EXITS && trace->side_exits * 4 > trace->iterations) {
+                trace->op_count = 0;
+                vm->hotness[open_ip] = 0;
+                if (trace->recordings >= TRACE_MAX_RECORDINGS) vm->trace_index[open_ip] = TRACE_BLACKLISTED;
+            }
+            return;
+        }
+    }
+    if (++vm->hotness[open_ip] < TRACE_HOT_THRESHOLD) return;
+
+    if (!slot) {
+        if (vm->trace_count == vm->trace_capacity) {
+            size_t new_capacity = vm->trace_capacity ? vm->trace_capacity * 2 : 8;
+            Trace *grown = (Trace*)vm_realloc(vm->traces, new_capacity * sizeof(Trace));
+            if (!grown) { vm->trace_index[open_ip] = TRACE_BLACKLISTED; return; }
+            vm->traces = grown;
+            vm->trace_capacity = new_capacity;
+        }
+        Trace *trace = &vm->traces[vm->trace_count];
+        memset(trace, 0, sizeof(Trace));
+        trace->ops = (TraceOp*)vm_alloc(TRACE_MAX_OPS * sizeof(TraceOp));
+        if (!trace->ops) { vm->trace_index[open_ip] = TRACE_BLACKLISTED; return; }
+        trace->open_ip = open_ip;
+        slot = (uint32_t)++vm->trace_count;
+        vm->trace_index[open_ip] = slot;
+    }
+
+    Trace *trace = &vm->traces[slot - 1];
+    trace->recordings++;
+    trace->side_exits = 0;
+    trace->iterations = 0;
+    trace->cell_op_count = 0;
+    if (!record_trace(vm, open_ip, trace)) {
+        trace->op_count = 0;
+        vm->hotness[open_ip] = 0;
+        if (trace->recordings >= TRACE_MAX_RECORDINGS) vm->trace_index[open_ip] = TRACE_BLACKLISTED;
+    } else if (vm->engine_flags & BFVM_ENGINE_CACHE_CELLS) {
+        compile_trace_cells(trace);
+    }
+}
+
+
+// --- Hang Detection ---
+// A loop whose body is balanced, does no I/O and only contains such loops
+// depends on nothing but the cells in a fixed window around dp. If that window
+// repeats at the same back-edge, the loop can never exit. States are sampled
+// every HANG_CHECK_INTERVAL back-edges and compared Brent-style against a
+// snapshot that is re-taken at power-of-two distances, using a hash to reject
+// mismatches before the memcmp.
+static void free_hang_detector(BrainfuckVM *vm) {
+    vm_free(vm->hang_window);
+    vm_free(vm->hang_slots);
+    vm->hang_window = NULL;
+    vm->hang_slots = NULL;
+}
+
+// Best-effort like the other side tables: without them no hangs are reported.
+static void init_hang_detector(BrainfuckVM *vm) {
+    vm->hang_window = (uint32_t*)vm_calloc(vm->code_len ? vm->code_len : 1, sizeof(uint32_t));
+    vm->hang_slots = (HangSlot*)vm_alloc(HANG_SLOTS * sizeof(HangSlot));
+    if (!vm->hang_window || !vm->hang_slots) {
+        free_hang_detector(vm);
+        return;
+    }
+    for (int k = 0; k < HANG_SLOTS; ++k) vm->hang_slots[k].open_ip = SIZE_MAX;
+}
+
+// Cell window [lo, hi] the loop at `open_ip` can ever look at, relative to dp
+// at its back-edge. Returns 0 if the loop's state isn't confined to a window.
+static int hang_window(BrainfuckVM *vm, size_t open_ip, int32_t *lo, int32_t *hi) {
+    uint32_t cached = vm->hang_window[open_ip];
+    if (cached == HANG_WINDOW_NONE) return 0;
+    if (cached) {
+        *lo = (int32_t)((cached >> 8) & 0xFF) - HANG_MAX_WINDOW;
+        *hi = (int32_t)(cached & 0xFF) - HANG_MAX_WINDOW;
+        return 1;
+    }
+
+    size_t close_ip = vm->jump_table[open_ip];
+    int32_t offset = 0, min = 0, max = 0;
+    for (size_t i = open_ip + 1; i < close_ip; ++i) {
+        switch (vm->code[i]) {
+            case '>': offset++; break;
+            case '<': offset--; break;
+            case '.': case ',':
+                goto not_confined; // State would include the I/O streams
+            case '[': {
+                int32_t inner_lo, inner_hi;
+                if (!hang_window(vm, i, &inner_lo, &inner_hi)) goto not_confined;
+                if (offset + inner_lo < min) min = offset + inner_lo;
+                if (offset + inner_hi > max) max = offset + inner_hi;
+                i = vm->jump_table[i];
+                break;
+            }
+        }
+        if (offset < min) min = offset;
+        if (offset > max) max = offset;
+        if (max - min >= HANG_MAX_WINDOW) goto not_confined;
+    }
+    if (offset != 0) goto not_confined;
+
+    vm->hang_window[open_ip] = HANG_WINDOW_KNOWN |
+        ((uint32_t)(min + HANG_MAX_WINDOW) << 8) | (uint32_t)(max + HANG_MAX_WINDOW);
+    *lo = min;
+    *hi = max;
+    return 1;
+
+not_confined:
+    vm->hang_window[open_ip] = HANG_WINDOW_NONE;
+    return 0;
+}
+
+static uint32_t hang_hash(const uint8_t *state, size_t bytes) {
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (size_t k = 0; k < bytes; ++k) hash = (hash ^ state[k]) * 16777619u;
+    return hash;
+}
+
+// A fresh (non back-edge) entry starts a new run of the loop: forget its past.
+static void hang_loop_entry(BrainfuckVM *vm, size_t open_ip) {
+    HangSlot *slot = &vm->hang_slots[open_ip % HANG_SLOTS];
+    if (slot->open_ip == open_ip) slot->open_ip = SIZE_MAX;
+}
+
+// hang_back_edge over a tape of `stride` bytes per cell (a lockstep group's
+// interleaved lanes), with room for HANG_MAX_WINDOW cells at `snapshot`
+static int hang_check(BrainfuckVM *vm, const uint8_t *tape, size_t stride, uint8_t *snapshot,
+                      size_t open_ip, size_t dp) {
+    HangSlot *slot = &vm->hang_slots[open_ip % HANG_SLOTS];
+    int32_t lo, hi;
+
+    if (slot->open_ip != open_ip || slot->dp != dp) {
+        if (!hang_window(vm, open_ip, &lo, &hi)) return 0;
+        if ((lo < 0 && dp < (size_t)-lo) || dp + (size_t)hi >= vm->memory_size) return 0;
+        slot->open_ip = open_ip;
+        slot->dp = dp;
+        slot->lo = lo;
+        slot->width = hi - lo + 1;
+        slot->since_sample = 0;
+        slot->power = 1;
+        slot->lam = 0;
+        memcpy(snapshot, tape + (dp + lo) * stride, (size_t)slot->width * stride);
+        slot->hash = hang_hash(snapshot, (size_t)slot->width * stride);
+        return 0;
+    }
+    if (++slot->since_sample < HANG_CHECK_INTERVAL) return 0;
+    slot->since_sample = 0;
+
+    const uint8_t *window = tape + (dp + slot->lo) * stride;
+    size_t bytes = (size_t)slot->width * stride;
+    uint32_t hash = hang_hash(window, bytes);
+    if (hash == slot->hash && memcmp(window, snapshot, bytes) == 0) {
+        return 1;
+    }
+    if (++slot->lam == slot->power) {
+        memcpy(snapshot, window, bytes);
+        slot->hash = hash;
+        slot->power *= 2;
+        slot->lam = 0;
+    }
+    return 0;
+}
+
+// Called on a taken back-edge of the loop at `open_ip`. Returns 1 if the loop
+// provably never terminates.
+static int hang_back_edge(BrainfuckVM *vm, size_t open_ip, size_t dp) {
+    return hang_check(vm, vm->memory, 1, vm->hang_slots[open_ip % HANG_SLOTS].snapshot, open_ip, dp);
+}
+
+// Closed-form loops decline counts that don't exist; with every touched cell
+// on the tape that means the loop would spin forever.
+static int closed_form_never_terminates(const BrainfuckVM *vm, const LoopInfo *info) {
+    if (info->kind != LOOP_KIND_LINEAR && info->kind != LOOP_KIND_AFFINE) return 0;
+    uint8_t low_mask = (uint8_t)((1u << info->step_shift) - 1);
+    if (!(vm->memory[vm->dp] & low_mask)) return 0;
+    return !((info->min_offset < 0 && vm->dp < (size_t)-info->min_offset) ||
+             vm->dp + (size_t)info->max_offset >= vm->memory_size);
+}
+
+
+// --- Cancellation ---
+// Set from JS (e.g. by an AbortSignal listener, or from another thread when
+// the Wasm memory is shared) and cleared by the caller before each run. The
+// interpreter polls it every CANCEL_POLL_INTERVAL back-edges; traces yield to
+// the interpreter when the countdown runs out so they get polled too.
+static volatile int32_t cancel_flag = 0;
+
+EMSCRIPTEN_KEEPALIVE
+volatile int32_t *bfvm_cancel_flag(void) { return &cancel_flag; }
+
+static int cancel_requested(cancel_poll_t cancel_poll) {
+    return cancel_flag != 0 || (cancel_poll && cancel_poll());
+}
+
+// --- Op Counting and Slices ---
+// The countdown doubles as the op counter (ops are taken back-edges, trace
+// iterations included): each poll adds what was counted down since the last
+// load. Sliced instance runs load it with what is left of the slice when
+// that is less than the poll interval, so the poll that ends a slice comes
+// on time.
+static uint64_t vm_ops(const BrainfuckVM *vm) {
+    return vm->ops + (uint64_t)((int64_t)vm->poll_interval - vm->cancel_countdown);
+}
+
+static void reload_countdown(BrainfuckVM *vm) {
+    vm->ops = vm_ops(vm);
+    int32_t interval = CANCEL_POLL_INTERVAL;
+    if (vm->ops_limit) {
+        uint64_t left = vm->ops < vm->ops_limit ? vm->ops_limit - vm->ops : 0;
+        if (left < (uint64_t)interval) interval = (int32_t)left;
+    }
+    vm->poll_interval = interval;
+    vm->cancel_countdown = interval;
+}
+
+
+// --- Watchpoints ---
+// A shadow bitmap over the tape keeps the check on each access to one bit
+// test; only accesses to marked cells look through the watchpoint list.
+static int init_watchpoints(BrainfuckVM *vm, const BfvmWatchpoint *watchpoints, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (watchpoints[i].first >= vm->memory_size || watchpoints[i].count > vm->memory_size - watchpoints[i].first ||
+            !(watchpoints[i].kinds & (BFVM_WATCH_READ | BFVM_WATCH_WRITE | BFVM_WATCH_CHANGE))) {
+            return BF_ERR_INVALID_ARGS;
+        }
+    }
+    size_t words = (vm->memory_size + 63) / 64;
+    vm->watch_bits = (uint64_t*)vm_calloc(words, sizeof(uint64_t));
+    if (!vm->watch_bits) return BF_ERR_BREAKPOINT_ALLOC_FAILED;
+    for (size_t i = 0; i < count; ++i) {
+        size_t cell = (size_t)watchpoints[i].first;
+        size_t end = cell + (size_t)watchpoints[i].count;
+        for (; cell < end && (cell & 63); ++cell) vm->watch_bits[cell >> 6] |= 1ull << (cell & 63);
+        for (; cell + 64 <= end; cell += 64) vm->watch_bits[cell >> 6] = ~0ull;
+        for (; cell < end; ++cell) vm->watch_bits[cell >> 6] |= 1ull << (cell & 63);
+    }
+    vm->watchpoints = watchpoints;
+    vm->watch_count = count;
+    return BF_SUCCESS;
+}
+
+static void free_watchpoints(BrainfuckVM *vm) {
+    if (vm->watch_bits) vm_free(vm->watch_bits);
+    vm->watch_bits = NULL;
+}
+
+static inline int cell_watched(const BrainfuckVM *vm, size_t cell) {
+    return vm->watch_bits && ((vm->watch_bits[cell >> 6] >> (cell & 63)) & 1);
+}
+
+// Called after the instruction at `ip` read (BFVM_WATCH_READ) or stored to
+// (BFVM_WATCH_WRITE) `cell`; records the first matching watchpoint
+static int watch_access(BrainfuckVM *vm, size_t ip, size_t cell, int kind, uint8_t old_value) {
+    if (!cell_watched(vm, cell)) return 0;
+    uint8_t new_value = vm->memory[cell];
+    if (kind == BFVM_WATCH_WRITE && new_value != old_value) kind |= BFVM_WATCH_CHANGE;
+    for (size_t i = 0; i < vm->watch_count; ++i) {
+        const BfvmWatchpoint *watch = &vm->watchpoints[i];
+        int matched = watch->kinds & kind;
+        if (!matched || cell < watch->first || cell - watch->first >= watch->count) continue;
+        if (vm->watch_hit) {
+            vm->watch_hit->ip = ip;
+            vm->watch_hit->cell = cell;
+            vm->watch_hit->watchpoint = (int32_t)i;
+            vm->watch_hit->kind = (matched & BFVM_WATCH_CHANGE) ? BFVM_WATCH_CHANGE : matched;
+            vm->watch_hit->old_value = old_value;
+            vm->watch_hit->new_value = new_value;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// Whether a closed-form loop or clear run at dp could touch a watched cell;
+// such loops run instruction by instruction so every access is seen
+static int loop_watched(const BrainfuckVM *vm, const LoopInfo *info, size_t dp) {
+    size_t first = info->min_offset < 0 && dp < (size_t)-info->min_offset ? 0 : dp + (size_t)(ptrdiff_t)info->min_offset;
+    size_t last = dp + (size_t)info->max_offset;
+    if (last >= vm->memory_size) last = vm->memory_size - 1;
+    for (size_t cell = first; cell <= last; ++cell) {
+        if (cell_watched(vm, cell)) return 1;
+    }
+    return 0;
+}
+
+
+// --- Execution Loop ---
+// Runs from vm->ip until the end of the code or an error and returns
+// BF_SUCCESS or an error code. Written once and instantiated per variant:
+// `variant` is a constant in each caller below, so the hooks of the other
+// variants compile away. ip/dp live in locals and are written back to the VM
+// around helpers that work on it.
+static inline __attribute__((always_inline))
+int execute_loop(BrainfuckVM *vm, const unsigned variant) {
+    const char *code = vm->code;
+    const size_t code_len = vm->code_len;
+    uint8_t *memory = vm->memory;
+    size_t ip = vm->ip;
+    size_t dp = vm->dp;
+    uint64_t steps_left = vm->step_budget;
+    int result_code = BF_SUCCESS;
+
+    while (ip < code_len) {
+        if (variant & VARIANT_STEP) {
+            if (steps_left == 0) {
+                result_code = BFVM_PAUSED; goto done;
+            }
+            steps_left--;
+        }
+
+        // --- Debug Hook Call ---
+        if ((variant & VARIANT_DEBUG) && vm->debug_hook) {
+            // Call JS callback before executing instruction
+            if (vm->debug_hook(ip, dp, memory[dp])) {
+                result_code = BF_ERR_DEBUG_HALT_REQUESTED;
+                goto done;
+            }
+        }
+        // Watchpoints (VARIANT_WATCH) are checked per cell access in the cases
+        // below, against the bitmap built by init_watchpoints.
+
+        char command = code[ip];
+        size_t count = 1; // For instruction folding
+
+        switch (command) {
+            case '>':
+            case '<':
+                 // Instruction Folding
+                while (ip + 1 < code_len && code[ip + 1] == command) {
+                    count++;
+                    ip++;
+                }
+                if (command == '>') {
+                    if (dp + count >= vm->memory_size) {
+                        result_code = BF_ERR_MEMORY_OUT_OF_BOUNDS; goto done;
+                    }
+                    dp += count;
+                } else { // command == '<'
+                    if (dp < count) { // Check for underflow before subtraction
+                        result_code = BF_ERR_MEMORY_OUT_OF_BOUNDS; goto done;
+                    }
+                    dp -= count;
+                }
+                break;
+            case '+':
+            case '-': {
+                const size_t op_ip = ip;
+                const uint8_t old_value = memory[dp];
+                 // Instruction Folding
+                while (ip + 1 < code_len && code[ip + 1] == command) {
+                    count++;
+                    ip++;
+                }
+                if (command == '+') {
+                    memory[dp] += count; // Let uint8_t wrap naturally
+                } else { // command == '-'
+                    memory[dp] -= count; // Let uint8_t wrap naturally
+                }
+                if ((variant & VARIANT_WATCH) && watch_access(vm, op_ip, dp, BFVM_WATCH_WRITE, old_value)) {
+                    result_code = BF_ERR_WATCHPOINT_HIT; goto done;
+                }
+                break;
+            }
+            case '.':
+                if (vm->output_ptr >= vm->output_max_len && (result_code = flush_output(vm)) != BF_SUCCESS) {
+                    goto done;
+                }
+                vm->output_buffer[vm->output_ptr++] = memory[dp];
+                if ((variant & VARIANT_WATCH) && watch_access(vm, ip, dp, BFVM_WATCH_READ, memory[dp])) {
+                    result_code = BF_ERR_WATCHPOINT_HIT; goto done;
+                }
+                break;
+            case ',': {
+                const uint8_t old_value = memory[dp];
+                memory[dp] = read_input(vm); // 0 at EOF
+                if ((variant & VARIANT_WATCH) && watch_access(vm, ip, dp, BFVM_WATCH_WRITE, old_value)) {
+                    result_code = BF_ERR_WATCHPOINT_HIT; goto done;
+                }
+                break;
+            }
+            case '[': {
+                const LoopInfo *info = vm->loop_index && vm->loop_index[ip] ? &vm->loops[vm->loop_index[ip] - 1] : NULL;
+                if (variant & VARIANT_WATCH) {
+                    if (watch_access(vm, ip, dp, BFVM_WATCH_READ, memory[dp])) {
+                        result_code = BF_ERR_WATCHPOINT_HIT; goto done;
+                    }
+                    if (info && loop_watched(vm, info, dp)) info = NULL;
+                }
+                vm->dp = dp;
+                if (info && info->kind == LOOP_KIND_CLEAR_RANGE && run_clear_range(vm, info)) {
+                    // Whole clear/set run at once, regardless of the first cell
+                    ip = info->range_end_ip;
+                    dp = vm->dp;
+                } else if (memory[dp] == 0) {
+                    // Jump using precomputed table
+                    ip = vm->jump_table[ip];
+                    break;
+                }
+                // Closed-form execution of linear and nested linear loops
+                else if (info && run_closed_form_loop(vm, info)) {
+                    ip = info->end_ip; // Skip the whole loop
+                } else {
+                    if (variant & VARIANT_HANG_DETECT) {
+                        if (info && closed_form_never_terminates(vm, info)) {
+                            result_code = BF_ERR_INFINITE_LOOP; goto done;
+                        }
+                        if (vm->hang_slots) hang_loop_entry(vm, ip);
+                    }
+                    break;
+                }
+                 // Debug hook after optimization if stepping
+                if ((variant & VARIANT_DEBUG) && vm->debug_hook) {
+                    if (vm->debug_hook(ip, dp, memory[dp])) {
+                        result_code = BF_ERR_DEBUG_HALT_REQUESTED; goto done;
+                    }
+                }
+                break;
+            }
+            case ']':
+                 if ((variant & VARIANT_WATCH) && watch_access(vm, ip, dp, BFVM_WATCH_READ, memory[dp])) {
+                     result_code = BF_ERR_WATCHPOINT_HIT; goto done;
+                 }
+                 if (memory[dp] != 0) {
+                     // Jump using precomputed table
+                     ip = vm->jump_table[ip];
+                     if (--vm->cancel_countdown <= 0) {
+                         if (cancel_requested(vm->cancel_poll)) {
+                             result_code = BF_ERR_CANCELLED; goto done;
+                         }
+                         reload_countdown(vm);
+                         if (vm->ops_limit && vm->ops >= vm->ops_limit) {
+                             ip++; // Resume in the loop body (the back-edge is taken)
+                             result_code = BFVM_PAUSED; goto done;
+                         }
+                     }
+                     if ((variant & VARIANT_HANG_DETECT) && vm->hang_slots && hang_back_edge(vm, ip, dp)) {
+                         result_code = BF_ERR_INFINITE_LOOP; goto done;
+                     }
+                     if (!(variant & VARIANT_STEP) && vm->trace_index) {
+                         vm->ip = ip;
+                         vm->dp = dp;
+                         trace_back_edge(vm);
+                         ip = vm->ip;
+                         dp = vm->dp;
+                     }
+                 }
+                 break;
+            // Ignore other characters (comments)
+        }
+        ip++; // Move to the next instruction
+    }
+
+done:
+    vm->ip = ip;
+    vm->dp = dp;
+    if (variant & VARIANT_STEP) vm->step_budget = steps_left;
+    return result_code;
+}
+
+static int execute_fast(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_FAST); }
+static int execute_debug(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_DEBUG | VARIANT_WATCH); }
+static int execute_watch(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_WATCH); }
+static int execute_hang_detect(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_HANG_DETECT); }
+static int execute_step(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_STEP); }
+static int execute_step_hang_detect(BrainfuckVM *vm) { return execute_loop(vm, VARIANT_STEP | VARIANT_HANG_DETECT); }
+
+
+// --- Compiled Programs ---
+// The pre-scan results (jump table and loop analysis) depend only on the code,
+// so hosts that run the same program many times can compile it once and skip
+// the pre-scan on every run. The tables are read-only while running.
+struct BrainfuckProgram {
+    const char *code;
+    size_t code_len;
+    size_t *jump_table;
+    uint32_t *loop_index;
+    LoopInfo *loops;
+    size_t loop_count;
+    char *owned_code;           // Private copy for bfvm_compile (NULL when borrowed)
+};
+
+// Points a VM at a program's code and read-only tables
+static void borrow_program(BrainfuckVM *vm, const BrainfuckProgram *program) {
+    vm->code = program->code;
+    vm->code_len = program->code_len;
+    vm->jump_table = program->jump_table;
+    vm->loop_index = program->loop_index;
+    vm->loops = program->loops;
+    vm->loop_count = program->loop_count;
+}
+
+static int compile_program(BrainfuckProgram *program, const char *code, size_t code_len) {
+    BrainfuckVM vm;
+    memset(&vm, 0, sizeof(BrainfuckVM));
+    vm.code = code;
+    vm.code_len = code_len;
+
+    int result_code = build_jump_table(&vm);
+    if (result_code != BF_SUCCESS) {
+        return result_code; // Error during pre-scan
+    }
+    analyze_loops(&vm);
+
+    program->code = code;
+    program->code_len = code_len;
+    program->jump_table = vm.jump_table;
+    program->loop_index = vm.loop_index;
+    program->loops = vm.loops;
+    program->loop_count = vm.loop_count;
+    program->owned_code = NULL;
+    return BF_SUCCESS;
+}
+
+static void free_program_tables(BrainfuckProgram *program) {
+    BrainfuckVM vm;
+    memset(&vm, 0, sizeof(BrainfuckVM));
+    vm.loop_index = program->loop_index;
+    vm.loops = program->loops;
+    vm.loop_count = program->loop_count;
+    free_loops(&vm);
+    vm_free(program->jump_table);
+    program->jump_table = NULL;
+    program->loop_index = NULL;
+    program->loops = NULL;
+    program->loop_count = 0;
+}
+
+// Compiles `code_buf`, copying it unless `borrow` is set. Returns NULL and
+// stores the BF_ERR_* code in *error_out (if given) on failure.
+static BrainfuckProgram *compile_new(const char* code_buf, size_t code_len, int borrow, int *error_out) {
+    int result_code = BF_ERR_JUMPTABLE_ALLOC_FAILED;
+    BrainfuckProgram *program = NULL;
+    char *code_copy = NULL;
+
+    if (!code_buf) {
+        result_code = BF_ERR_INVALID_ARGS;
+        goto fail;
+    }
+    // The program outlives any run, so it must not land in the run arena
+    int arena_was_active = arena_suspend();
+    program = (BrainfuckProgram*)vm_alloc(sizeof(BrainfuckProgram));
+    code_copy = borrow ? NULL : (char*)vm_alloc(code_len ? code_len : 1);
+    if (program && (borrow || code_copy)) {
+        if (code_copy) memcpy(code_copy, code_buf, code_len);
+        result_code = compile_program(program, borrow ? code_buf : code_copy, code_len);
+    }
+    arena_resume(arena_was_active);
+    if (!program || (!borrow && !code_copy) || result_code != BF_SUCCESS) goto fail;
+    program->owned_code = code_copy;
+    return program;
+
+fail:
+    vm_free(program);
+    vm_free(code_copy);
+    if (error_out) *error_out = result_code;
+    return NULL;
+}
+
+EMSCRIPTEN_KEEPALIVE
+BrainfuckProgram *bfvm_compile(const char* code_buf, size_t code_len, int *error_out) {
+    return compile_new(code_buf, code_len, 0, error_out);
+}
+
+// Borrows the code (e.g. an mmap'd file) instead of copying it
+EMSCRIPTEN_KEEPALIVE
+BrainfuckProgram *bfvm_compile_view(const char* code_buf, size_t code_len, int *error_out) {
+    return compile_new(code_buf, code_len, 1, error_out);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void bfvm_program_free(BrainfuckProgram *program) {
+    if (!program) return;
+    free_program_tables(program);
+    vm_free(program->owned_code);
+    vm_free(program);
+}
+
+
+// --- Core Execution Function (Updated) ---
+// Runs a compiled program; same contract as bfvm_run_ex without the pre-scan.
+// With a `tape` the run uses it as it is and leaves the final state in it;
+// otherwise it allocates and clears its own. It starts at start_ip/start_dp.
+static int run_program(
+    const BrainfuckProgram *program,
+    uint8_t *tape, size_t start_ip, size_t start_dp,
+    const BfvmWatchpoint *watchpoints, size_t watch_count, BfvmWatchHit *watch_hit,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t requested_mem_size,
+    // Debugging arguments:
+    intptr_t debug_callback_ptr, // Function pointer (as integer) from JS addFunction
+    int single_step,          // Boolean flag (0 or 1) for single stepping
+    int engine_flags,         // BFVM_ENGINE_* bits
+    intptr_t cancel_poll_ptr, // Optional cancel_poll_t (0 = only the cancel flag)
+    BfvmResult *result        // Filled in on success and on errors
+) {
+    BrainfuckVM vm;
+    int result_code = BF_SUCCESS;
+    int arena_owned;
+
+    // --- Validate Input Args ---
+    if (!result) {
+        return BF_ERR_INVALID_ARGS;
+    }
+    memset(result, 0, sizeof(BfvmResult));
+    if (!program || !out_buf || requested_mem_size == 0) {
+        result->error = BF_ERR_INVALID_ARGS;
+        return BF_ERR_INVALID_ARGS;
+    }
+    arena_owned = arena_begin();
+
+    // --- Initialize VM State ---
+    memset(&vm, 0, sizeof(BrainfuckVM));
+    vm.memory = NULL;
+    vm.debug_hook = (debug_callback_t)debug_callback_ptr; // Cast integer pointer back
+    vm.single_step_mode = single_step;
+    vm.engine_flags = engine_flags;
+    vm.cancel_poll = (cancel_poll_t)cancel_poll_ptr;
+    reload_countdown(&vm);
+
+    // --- Allocate Memory Tape ---
+    if (tape) {
+        vm.memory = tape;
+    } else {
+        vm.memory = (uint8_t*)vm_alloc(requested_mem_size);
+        if (vm.memory == NULL) {
+            result_code = BF_ERR_TAPE_ALLOC_FAILED;
+            goto cleanup_and_exit; // Use goto for centralized cleanup
+        }
+        memset(vm.memory, 0, requested_mem_size);
+    }
+    vm.memory_size = requested_mem_size;
+
+    // --- Set up pointers and lengths ---
+    vm.dp = start_dp;
+    vm.ip = start_ip;
+    vm.input_ptr = 0;
+    vm.output_ptr = 0;
+    vm.input_buffer = input_buf;
+    vm.input_len = in_len;
+    vm.output_buffer = out_buf;
+    vm.output_max_len = out_len_max;
+
+    // --- Borrow the Precomputed Tables ---
+    borrow_program(&vm, program);
+    vm.watch_hit = watch_hit;
+    if (watch_count > 0 && (result_code = init_watchpoints(&vm, watchpoints, watch_count)) != BF_SUCCESS) {
+        goto cleanup_and_exit;
+    }
+
+    // --- Execution Loop ---
+    // Tracing would skip over the instructions the debugger wants to see, the
+    // accesses watchpoints check and the back-edges the hang detector samples
+    if (vm.debug_hook && vm.single_step_mode) {
+        result_code = execute_debug(&vm);
+    } else if (vm.watch_bits) {
+        result_code = execute_watch(&vm);
+    } else if (engine_flags & BFVM_ENGINE_HANG_DETECT) {
+        init_hang_detector(&vm);
+        result_code = execute_hang_detect(&vm);
+    } else {
+        if (engine_flags & BFVM_ENGINE_TRACE) init_traces(&vm);
+        result_code = execute_fast(&vm);
+    }
+    if (result_code != BF_SUCCESS) {
+        goto cleanup_and_exit;
+    }
+
+    // --- Normal Exit ---
+    if (vm.output_ptr < vm.output_max_len) {
+         vm.output_buffer[vm.output_ptr] = '\0';
+    }
+
+
+cleanup_and_exit:
+    result->output_len = vm.output_flushed + vm.output_ptr;
+    result->input_read = vm.input_consumed + vm.input_ptr;
+    result->data_pointer = vm.dp;
+    result->error = result_code;
+    result->ops = vm_ops(&vm);
+    // --- Free Dynamically Allocated Memory ---
+    // (the jump table and loop tables belong to the program, the tape may be the caller's)
+    if (vm.memory != NULL && vm.memory != tape) {
+        vm_free(vm.memory);
     }
-    if (vm.jump_table != NULL) { // Free the jump table
-        free(vm.jump_table);
+    free_hang_detector(&vm);
+    free_traces(&vm);
+    free_watchpoints(&vm);
+    arena_end(arena_owned);
+    // Return the result code (BF_SUCCESS or error code)
+    return result_code;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run_program_ex(
+    const BrainfuckProgram *program,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t requested_mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr,
+    BfvmResult *result
+) {
+    return run_program(program, NULL, 0, 0, NULL, 0, NULL, input_buf, in_len, out_buf, out_len_max, requested_mem_size,
+                       debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr, result);
+}
+
+// Runs on the caller's tape of `mem_size` cells (see bfvm.h).
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run_program_tape(
+    const BrainfuckProgram *program,
+    uint8_t *tape, size_t start_ip, size_t start_dp,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr,
+    BfvmResult *result
+) {
+    if (!tape || (program && start_ip > program->code_len) || start_dp >= mem_size) {
+        if (result) {
+            memset(result, 0, sizeof(BfvmResult));
+            result->error = BF_ERR_INVALID_ARGS;
+        }
+        return BF_ERR_INVALID_ARGS;
+    }
+    return run_program(program, tape, start_ip, start_dp, NULL, 0, NULL, input_buf, in_len, out_buf, out_len_max,
+                       mem_size, debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr, result);
+}
+
+// Same as bfvm_run_program_tape, stopping at the first access a watchpoint
+// matches (see bfvm.h). The tape may be NULL (a cleared one of mem_size cells).
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run_program_watch(
+    const BrainfuckProgram *program,
+    uint8_t *tape, size_t start_ip, size_t start_dp,
+    const BfvmWatchpoint *watchpoints, size_t watch_count, BfvmWatchHit *hit,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr,
+    BfvmResult *result
+) {
+    if ((program && start_ip > program->code_len) || start_dp >= mem_size || (watch_count > 0 && !watchpoints)) {
+        if (result) {
+            memset(result, 0, sizeof(BfvmResult));
+            result->error = BF_ERR_INVALID_ARGS;
+        }
+        return BF_ERR_INVALID_ARGS;
+    }
+    if (hit) memset(hit, 0, sizeof(BfvmWatchHit));
+    return run_program(program, tape, start_ip, start_dp, watchpoints, watch_count, hit, input_buf, in_len,
+                       out_buf, out_len_max, mem_size, debug_callback_ptr, single_step, engine_flags,
+                       cancel_poll_ptr, result);
+}
+
+// One-shot entry point: compiles in place, runs and frees the tables.
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run_ex(
+    const char* code_buf, size_t code_len,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t requested_mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr,
+    BfvmResult *result
+) {
+    BrainfuckProgram program;
+    int result_code;
+    int arena_owned;
+
+    // --- Validate Input Args ---
+    if (!result) {
+        return BF_ERR_INVALID_ARGS;
+    }
+    if (!code_buf || !out_buf || requested_mem_size == 0) {
+        memset(result, 0, sizeof(BfvmResult));
+        result->error = BF_ERR_INVALID_ARGS;
+        return BF_ERR_INVALID_ARGS;
+    }
+    arena_owned = arena_begin(); // The tables are per-run here
+
+    // --- Precompute Jump Table ---
+    result_code = compile_program(&program, code_buf, code_len);
+    if (result_code == BF_SUCCESS) {
+        result_code = bfvm_run_program_ex(&program, input_buf, in_len, out_buf, out_len_max, requested_mem_size,
+                                          debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr, result);
+        free_program_tables(&program);
+    } else {
+        memset(result, 0, sizeof(BfvmResult));
+        result->error = result_code;
     }
-    // Return the result code (either byte count or error code)
+    arena_end(arena_owned);
     return result_code;
 }
 
 
+// --- Int-Result Entry Points ---
+// Return the bytes written or a BF_ERR_* code in one int, which is what the
+// JS wrappers of the wasm32 build use. Outputs that don't fit an int fail
+// with BF_ERR_RESULT_OVERFLOW instead of wrapping to a negative "error".
+static int result_as_int(int result_code, const BfvmResult *result) {
+    if (result_code != BF_SUCCESS) return result_code;
+    if (result->output_len > INT32_MAX) return BF_ERR_RESULT_OVERFLOW;
+    return (int)result->output_len;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run_program(
+    const BrainfuckProgram *program,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t requested_mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr
+) {
+    BfvmResult result;
+    int result_code = bfvm_run_program_ex(program, input_buf, in_len, out_buf, out_len_max, requested_mem_size,
+                                          debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr, &result);
+    return result_as_int(result_code, &result);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_run(
+    const char* code_buf, size_t code_len,
+    const char* input_buf, size_t in_len,
+    char* out_buf, size_t out_len_max,
+    size_t requested_mem_size,
+    intptr_t debug_callback_ptr,
+    int single_step,
+    int engine_flags,
+    intptr_t cancel_poll_ptr
+) {
+    BfvmResult result;
+    int result_code = bfvm_run_ex(code_buf, code_len, input_buf, in_len, out_buf, out_len_max, requested_mem_size,
+                                  debug_callback_ptr, single_step, engine_flags, cancel_poll_ptr, &result);
+    return result_as_int(result_code, &result);
+}
+
+
+// --- Instances (native embedding, see bfvm.h) ---
+// A VM whose state persists between calls, with its own tape and I/O
+// buffers. It outlives any single run, so it is allocated with the run arena
+// suspended, and so are the trace tables it grows while running.
+struct BfvmInstance {
+    BrainfuckVM vm;
+    BfvmIO io;
+    int status;                 // BFVM_PAUSED until the run ends, then its result
+};
+
+EMSCRIPTEN_KEEPALIVE
+void bfvm_instance_free(BfvmInstance *instance) {
+    if (!instance) return;
+    free_hang_detector(&instance->vm);
+    free_traces(&instance->vm);
+    vm_free(instance->vm.memory);
+    vm_free(instance->vm.input_storage);
+    vm_free(instance->vm.output_buffer);
+    vm_free(instance);
+}
+
+EMSCRIPTEN_KEEPALIVE
+BfvmInstance *bfvm_instance_create(const BrainfuckProgram *program, const BfvmConfig *config, int *error_out) {
+    if (!program || !config || config->memory_size == 0) {
+        if (error_out) *error_out = BF_ERR_INVALID_ARGS;
+        return NULL;
+    }
+    size_t buffer_size = config->io_buffer_size ? config->io_buffer_size : BFVM_DEFAULT_IO_BUFFER_SIZE;
+    int arena_was_active = arena_suspend();
+    BfvmInstance *instance = (BfvmInstance*)vm_calloc(1, sizeof(BfvmInstance));
+    if (!instance) {
+        arena_resume(arena_was_active);
+        if (error_out) *error_out = BF_ERR_TAPE_ALLOC_FAILED;
+        return NULL;
+    }
+    BrainfuckVM *vm = &instance->vm;
+    instance->io = config->io;
+    instance->status = BFVM_PAUSED;
+
+    vm->memory = (uint8_t*)vm_calloc(config->memory_size, 1);
+    vm->memory_size = config->memory_size;
+    vm->input_storage = (char*)vm_alloc(buffer_size);
+    vm->output_buffer = (char*)vm_alloc(buffer_size);
+    if (!vm->memory || !vm->input_storage || !vm->output_buffer) {
+        bfvm_instance_free(instance);
+        arena_resume(arena_was_active);
+        if (error_out) *error_out = BF_ERR_TAPE_ALLOC_FAILED;
+        return NULL;
+    }
+    vm->input_buffer = vm->input_storage;
+    vm->input_capacity = buffer_size;
+    vm->output_max_len = buffer_size;
+    vm->io = &instance->io;
+
+    // Borrow the program's tables, like bfvm_run_program
+    borrow_program(vm, program);
+
+    vm->engine_flags = config->engine_flags;
+    reload_countdown(vm);
+    if (vm->engine_flags & BFVM_ENGINE_HANG_DETECT) {
+        init_hang_detector(vm);
+    } else if (vm->engine_flags & BFVM_ENGINE_TRACE) {
+        init_traces(vm);
+    }
+    arena_resume(arena_was_active);
+    return instance;
+}
+
+// Runs the instance to the end (INSTANCE_RUN), for `budget` dispatches
+// (INSTANCE_STEP) or for about `budget` ops on the full engine (INSTANCE_SLICE)
+#define INSTANCE_RUN 0
+#define INSTANCE_STEP 1
+#define INSTANCE_SLICE 2
+
+static int instance_call(BfvmInstance *instance, int mode, uint64_t budget, BfvmResult *result) {
+    if (!instance) return BF_ERR_INVALID_ARGS;
+    BrainfuckVM *vm = &instance->vm;
+
+    if (instance->status == BFVM_PAUSED) {
+        int hang_detect = vm->engine_flags & BFVM_ENGINE_HANG_DETECT;
+        int arena_was_active = arena_suspend();
+        int result_code;
+        uint64_t ops = vm_ops(vm);
+        vm->ops_limit = 0;
+        if (mode == INSTANCE_SLICE) {
+            if (budget == 0) budget = 1;
+            vm->ops_limit = budget < UINT64_MAX - ops ? ops + budget : UINT64_MAX;
+        }
+        reload_countdown(vm);
+        if (mode == INSTANCE_STEP) {
+            vm->step_budget = budget;
+            result_code = hang_detect ? execute_step_hang_detect(vm) : execute_step(vm);
+        } else {
+            result_code = hang_detect ? execute_hang_detect(vm) : execute_fast(vm);
+        }
+        int flush_code = flush_output(vm);
+        if (flush_code != BF_SUCCESS && (result_code == BF_SUCCESS || result_code == BFVM_PAUSED)) {
+            result_code = flush_code;
+        }
+        instance->status = result_code;
+        arena_resume(arena_was_active);
+    }
+
+    if (result) {
+        result->output_len = vm->output_flushed + vm->output_ptr;
+        result->input_read = vm->input_consumed + vm->input_ptr;
+        result->data_pointer = vm->dp;
+        result->error = instance->status == BFVM_PAUSED ? BF_SUCCESS : instance->status;
+        result->reserved = 0;
+        result->ops = vm_ops(vm);
+    }
+    return instance->status;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_instance_run(BfvmInstance *instance, BfvmResult *result) {
+    return instance_call(instance, INSTANCE_RUN, 0, result);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_instance_step(BfvmInstance *instance, uint64_t max_steps, BfvmResult *result) {
+    return instance_call(instance, INSTANCE_STEP, max_steps, result);
+}
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_instance_slice(BfvmInstance *instance, size_t max_ops, BfvmResult *result) {
+    return instance_call(instance, INSTANCE_SLICE, max_ops, result);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t *bfvm_instance_tape(BfvmInstance *instance, size_t *size, size_t *ip, size_t *dp) {
+    if (!instance) return NULL;
+    if (size) *size = instance->vm.memory_size;
+    if (ip) *ip = instance->vm.ip;
+    if (dp) *dp = instance->vm.dp;
+    return instance->vm.memory;
+}
+
+
+// --- Lockstep Batches ---
+// Up to LOCKSTEP_LANES jobs of a batch run as one: their tapes are
+// interleaved (cell c of lane l at tape[c * LOCKSTEP_LANES + l]), so cell
+// arithmetic, clear runs and LINEAR loops are one vector operation for every
+// lane. All lanes share ip, dp and the number of ',' and '.' executed. When a
+// bracket sees different cells across lanes, the minority is split off: its
+// tape is copied out and it continues alone on the regular engine from that
+// instruction. Programs whose control flow doesn't depend on the input stay
+// in lockstep to the end. With BFVM_ENGINE_HANG_DETECT the group fingerprints
+// its loops like the interpreter, over all lanes' rows of the window: when
+// they repeat, every lane still in the group hangs. Lanes split off run on
+// the hang-detecting interpreter.
+typedef uint8_t LaneVec __attribute__((vector_size(LOCKSTEP_LANES)));
+
+typedef struct {
+    const BrainfuckProgram *program;
+    BfvmBatchJob *jobs;         // One per lane
+    uint32_t active;            // Lanes still running in lockstep
+    uint8_t *tape;
+    size_t mem_size;
+    int engine_flags;
+    size_t dp;
+    size_t reads;               // ',' executed (lane l has read min(reads, in_len) bytes)
+    size_t writes;              // '.' executed
+    uint64_t ops;               // Back-edges taken by the group
+    cancel_poll_t cancel_poll;
+    BrainfuckVM hang;           // Hang detector tables (HANG_DETECT; hang.hang_slots NULL otherwise)
+    uint8_t *hang_snapshots;    // HANG_SLOTS windows of HANG_MAX_WINDOW rows
+} LockstepGroup;
+
+static inline LaneVec lanes_load(const uint8_t *row) {
+    LaneVec v;
+    memcpy(&v, row, sizeof(LaneVec)); // Rows are only 16-byte aligned
+    return v;
+}
+
+static inline void lanes_store(uint8_t *row, LaneVec v) {
+    memcpy(row, &v, sizeof(LaneVec));
+}
+
+static inline uint8_t *lanes_row(const LockstepGroup *group, size_t cell) {
+    return group->tape + cell * LOCKSTEP_LANES;
+}
+
+// Bit l set for each lane l whose byte is non-zero
+static inline uint32_t lanes_nonzero(LaneVec v) {
+    uint32_t mask = 0;
+    for (int lane = 0; lane < LOCKSTEP_LANES; ++lane) mask |= (uint32_t)(v[lane] != 0) << lane;
+    return mask;
+}
+
+static size_t lane_input_read(const LockstepGroup *group, const BfvmBatchJob *job) {
+    return group->reads < job->in_len ? group->reads : job->in_len;
+}
+
+static void lockstep_finish(LockstepGroup *group, int lane, int result_code) {
+    BfvmBatchJob *job = &group->jobs[lane];
+    memset(&job->result, 0, sizeof(BfvmResult));
+    job->result.output_len = group->writes;
+    job->result.input_read = lane_input_read(group, job);
+    job->result.data_pointer = group->dp;
+    job->result.error = result_code;
+    job->result.ops = group->ops;
+    if (result_code == BF_SUCCESS && group->writes < job->out_len_max) job->out_buf[group->writes] = '\0';
+    group->active &= ~(1u << lane);
+}
+
+static void lockstep_finish_all(LockstepGroup *group, int result_code) {
+    while (group->active) lockstep_finish(group, __builtin_ctz(group->active), result_code);
+}
+
+// Continues one lane on its own from instruction `ip` (not executed yet)
+static void lockstep_split(LockstepGroup *group, int lane, size_t ip) {
+    BfvmBatchJob *job = &group->jobs[lane];
+    BrainfuckVM vm;
+    int result_code;
+
+    memset(&vm, 0, sizeof(BrainfuckVM));
+    borrow_program(&vm, group->program);
+    vm.ip = ip;
+    vm.dp = group->dp;
+    vm.input_buffer = job->input;
+    vm.input_len = job->in_len;
+    vm.input_ptr = lane_input_read(group, job);
+    vm.output_buffer = job->out_buf;
+    vm.output_max_len = job->out_len_max;
+    vm.output_ptr = group->writes;
+    vm.engine_flags = group->engine_flags;
+    vm.cancel_poll = group->cancel_poll;
+    vm.ops = group->ops;
+    reload_countdown(&vm);
+    vm.memory = (uint8_t*)vm_alloc(group->mem_size);
+    if (vm.memory) {
+        for (size_t cell = 0; cell < group->mem_size; ++cell) vm.memory[cell] = lanes_row(group, cell)[lane];
+        vm.memory_size = group->mem_size;
+        if (vm.engine_flags & BFVM_ENGINE_HANG_DETECT) {
+            init_hang_detector(&vm);
+            result_code = execute_hang_detect(&vm);
+        } else {
+            if (vm.engine_flags & BFVM_ENGINE_TRACE) init_traces(&vm);
+            result_code = execute_fast(&vm);
+        }
+        if (result_code == BF_SUCCESS && vm.output_ptr < vm.output_max_len) vm.output_buffer[vm.output_ptr] = '\0';
+    } else {
+        result_code = BF_ERR_TAPE_ALLOC_FAILED;
+    }
+
+    memset(&job->result, 0, sizeof(BfvmResult));
+    job->result.output_len = vm.output_ptr;
+    job->result.input_read = vm.input_ptr;
+    job->result.data_pointer = vm.dp;
+    job->result.error = result_code;
+    job->result.ops = vm_ops(&vm);
+    vm_free(vm.memory);
+    free_hang_detector(&vm);
+    free_traces(&vm);
+    group->active &= ~(1u << lane);
+}
+
+static void lockstep_split_mask(LockstepGroup *group, uint32_t lanes, size_t ip) {
+    lanes &= group->active;
+    while (lanes) {
+        int lane = __builtin_ctz(lanes);
+        lanes &= lanes - 1;
+        lockstep_split(group, lane, ip);
+    }
+}
+
+// A bracket at `ip` saw non-zero cells in `nonzero` (a strict, non-empty
+// subset of the active lanes): the larger side stays in lockstep
+static void lockstep_diverge(LockstepGroup *group, uint32_t nonzero, size_t ip) {
+    uint32_t zero = group->active & ~nonzero;
+    lockstep_split_mask(group, __builtin_popcount(nonzero) >= __builtin_popcount(zero) ? zero : nonzero, ip);
+}
+
+static int lockstep_in_bounds(const LockstepGroup *group, const LoopInfo *info) {
+    return !((info->min_offset < 0 && group->dp < (size_t)-info->min_offset) ||
+             group->dp + (size_t)info->max_offset >= group->mem_size);
+}
+
+// run_clear_range for all lanes (the values don't depend on the cells)
+static int lockstep_clear_range(LockstepGroup *group, const LoopInfo *info) {
+    if (!lockstep_in_bounds(group, info)) return 0;
+    size_t start = group->dp - (info->range_dir > 0 ? 0 : info->range_len - 1);
+    for (size_t k = 0; k < info->range_len; ++k) {
+        memset(lanes_row(group, start + k), info->range_values ? info->range_values[k] : info->range_fill, LOCKSTEP_LANES);
+    }
+    group->dp += (size_t)(ptrdiff_t)info->range_move;
+    return 1;
+}
+
+// run_linear_loop with per-lane trip counts as a vector. Lanes whose count
+// doesn't exist (the loop never ends) are split off at the '['.
+static void lockstep_linear_loop(LockstepGroup *group, const LoopInfo *info, size_t ip) {
+    uint8_t *counter_row = lanes_row(group, group->dp);
+    LaneVec counter = lanes_load(counter_row);
+    uint8_t low_mask = (uint8_t)((1u << info->step_shift) - 1);
+
+    lockstep_split_mask(group, lanes_nonzero(counter & low_mask), ip);
+    LaneVec trips = (LaneVec)(-counter) >> info->step_shift;
+    trips *= info->step_inv;
+    if (info->step_shift) trips &= (uint8_t)(0xFF >> info->step_shift);
+
+    for (int k = 0; k < info->cell_count; ++k) {
+        uint8_t *row = counter_row + (ptrdiff_t)info->offsets[k] * LOCKSTEP_LANES;
+        lanes_store(row, lanes_load(row) + trips * info->deltas[k]);
+    }
+    memset(counter_row, 0, LOCKSTEP_LANES);
+}
+
+// run_affine_loop lane by lane on a copy of the loop's cell window
+static int lockstep_affine_loop(LockstepGroup *group, const LoopInfo *info, size_t ip) {
+    size_t width = (size_t)(info->max_offset - info->min_offset) + 1;
+    uint8_t window[LOCKSTEP_MAX_GATHER];
+    if (width > LOCKSTEP_MAX_GATHER) return 0;
+
+    BrainfuckVM lane_vm;
+    memset(&lane_vm, 0, sizeof(BrainfuckVM));
+    lane_vm.memory = window;
+    lane_vm.memory_size = width;
+    lane_vm.dp = (size_t)-info->min_offset;
+    size_t first = group->dp + (size_t)(ptrdiff_t)info->min_offset;
+
+    for (uint32_t lanes = group->active; lanes; lanes &= lanes - 1) {
+        int lane = __builtin_ctz(lanes);
+        for (size_t k = 0; k < width; ++k) window[k] = lanes_row(group, first + k)[lane];
+        if (!run_affine_loop(&lane_vm, info)) {
+            lockstep_split(group, lane, ip); // Never ends; window untouched
+            continue;
+        }
+        for (size_t k = 0; k < width; ++k) lanes_row(group, first + k)[lane] = window[k];
+    }
+    return 1;
+}
+
+// Closed-form loop at `ip` for all lanes (zero lanes get zero trips, which
+// leaves them as skipping the loop would). Returns 0 if the loop must be
+// interpreted.
+static int lockstep_closed_form(LockstepGroup *group, const LoopInfo *info, size_t ip) {
+    const LoopInfo *loop = info->kind == LOOP_KIND_CLEAR_RANGE ? &group->program->loops[info->range_first - 1] : info;
+    if (!lockstep_in_bounds(group, loop)) return 0;
+    switch (loop->kind) {
+        case LOOP_KIND_LINEAR: lockstep_linear_loop(group, loop, ip); return 1;
+        case LOOP_KIND_AFFINE: return lockstep_affine_loop(group, loop, ip);
+        default: return 0;
+    }
+}
+
+// The group entered the loop at `ip` afresh
+static void lockstep_loop_entry(LockstepGroup *group, size_t ip) {
+    if (group->hang.hang_slots) hang_loop_entry(&group->hang, ip);
+}
+
+static int lockstep_hang_back_edge(LockstepGroup *group, size_t open_ip) {
+    if (!group->hang.hang_slots) return 0;
+    uint8_t *snapshot = group->hang_snapshots + (open_ip % HANG_SLOTS) * HANG_MAX_WINDOW * LOCKSTEP_LANES;
+    return hang_check(&group->hang, group->tape, LOCKSTEP_LANES, snapshot, open_ip, group->dp);
+}
+
+// The interpreter of execute_loop, over all active lanes at once
+static void lockstep_execute(LockstepGroup *group) {
+    const char *code = group->program->code;
+    const size_t code_len = group->program->code_len;
+    const size_t *jump_table = group->program->jump_table;
+    const uint32_t *loop_index = group->program->loop_index;
+    int32_t cancel_countdown = CANCEL_POLL_INTERVAL;
+    size_t ip = 0;
+
+    while (ip < code_len && group->active) {
+        char command = code[ip];
+        size_t count = 1;
+
+        switch (command) {
+            case '>':
+            case '<':
+                while (ip + 1 < code_len && code[ip + 1] == command) {
+                    count++;
+                    ip++;
+                }
+                if (command == '>' ? group->dp + count >= group->mem_size : group->dp < count) {
+                    lockstep_finish_all(group, BF_ERR_MEMORY_OUT_OF_BOUNDS);
+                    return;
+                }
+                group->dp = command == '>' ? group->dp + count : group->dp - count;
+                break;
+            case '+':
+            case '-': {
+                while (ip + 1 < code_len && code[ip + 1] == command) {
+                    count++;
+                    ip++;
+                }
+                uint8_t *row = lanes_row(group, group->dp);
+                lanes_store(row, lanes_load(row) + (uint8_t)(command == '+' ? count : 0 - count));
+                break;
+            }
+            case '.': {
+                const uint8_t *row = lanes_row(group, group->dp);
+                for (uint32_t lanes = group->active; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    BfvmBatchJob *job = &group->jobs[lane];
+                    if (group->writes >= job->out_len_max) {
+                        lockstep_finish(group, lane, BF_ERR_OUTPUT_OVERFLOW);
+                    } else {
+                        job->out_buf[group->writes] = (char)row[lane];
+                    }
+                }
+                group->writes++;
+                break;
+            }
+            case ',': {
+                uint8_t *row = lanes_row(group, group->dp);
+                for (uint32_t lanes = group->active; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    const BfvmBatchJob *job = &group->jobs[lane];
+                    row[lane] = job->input && group->reads < job->in_len ? (uint8_t)job->input[group->reads] : 0;
+                }
+                group->reads++;
+                break;
+            }
+            case '[': {
+                const LoopInfo *info = loop_index && loop_index[ip] ? &group->program->loops[loop_index[ip] - 1] : NULL;
+                if (info && info->kind == LOOP_KIND_CLEAR_RANGE && lockstep_clear_range(group, info)) {
+                    ip = info->range_end_ip;
+                    break;
+                }
+                uint32_t nonzero = lanes_nonzero(lanes_load(lanes_row(group, group->dp))) & group->active;
+                if (nonzero == 0) {
+                    ip = jump_table[ip];
+                } else if (info && lockstep_closed_form(group, info, ip)) {
+                    ip = info->end_ip;
+                } else if (nonzero != group->active) {
+                    lockstep_diverge(group, nonzero, ip);
+                    if (!(group->active & nonzero)) ip = jump_table[ip];
+                    else lockstep_loop_entry(group, ip);
+                } else {
+                    lockstep_loop_entry(group, ip);
+                }
+                break;
+            }
+            case ']': {
+                uint32_t nonzero = lanes_nonzero(lanes_load(lanes_row(group, group->dp))) & group->active;
+                if (nonzero == 0) break;
+                if (nonzero != group->active) {
+                    lockstep_diverge(group, nonzero, ip);
+                    if (!(group->active & nonzero)) break;
+                }
+                ip = jump_table[ip];
+                group->ops++;
+                if (--cancel_countdown <= 0) {
+                    if (cancel_requested(group->cancel_poll)) {
+                        lockstep_finish_all(group, BF_ERR_CANCELLED);
+                        return;
+                    }
+                    cancel_countdown = CANCEL_POLL_INTERVAL;
+                }
+                if (lockstep_hang_back_edge(group, ip)) {
+                    lockstep_finish_all(group, BF_ERR_INFINITE_LOOP);
+                    return;
+                }
+                break;
+            }
+        }
+        ip++;
+    }
+    lockstep_finish_all(group, BF_SUCCESS);
+}
+
+static void run_lockstep(const BrainfuckProgram *program, BfvmBatchJob *jobs, size_t job_count,
+                         size_t mem_size, int engine_flags, intptr_t cancel_poll) {
+    LockstepGroup group;
+    memset(&group, 0, sizeof(LockstepGroup));
+    group.program = program;
+    group.jobs = jobs;
+    group.mem_size = mem_size;
+    group.engine_flags = engine_flags & ~BFVM_ENGINE_LOCKSTEP;
+    group.cancel_poll = (cancel_poll_t)cancel_poll;
+    for (size_t k = 0; k < job_count; ++k) {
+        if (jobs[k].out_buf) {
+            group.active |= 1u << k;
+        } else {
+            memset(&jobs[k].result, 0, sizeof(BfvmResult));
+            jobs[k].result.error = BF_ERR_INVALID_ARGS;
+        }
+    }
+
+    int arena_owned = arena_begin();
+    group.tape = mem_size <= SIZE_MAX / LOCKSTEP_LANES ? (uint8_t*)vm_calloc(mem_size, LOCKSTEP_LANES) : NULL;
+    if (group.tape) {
+        if (engine_flags & BFVM_ENGINE_HANG_DETECT) {
+            // Best-effort like the interpreter's: without it the group just isn't checked
+            borrow_program(&group.hang, program);
+            group.hang.memory_size = mem_size;
+            group.hang_snapshots = (uint8_t*)vm_alloc((size_t)HANG_SLOTS * HANG_MAX_WINDOW * LOCKSTEP_LANES);
+            if (group.hang_snapshots) init_hang_detector(&group.hang);
+        }
+        lockstep_execute(&group);
+        vm_free(group.tape);
+        vm_free(group.hang_snapshots);
+        free_hang_detector(&group.hang);
+    } else {
+        lockstep_finish_all(&group, BF_ERR_TAPE_ALLOC_FAILED);
+    }
+    arena_end(arena_owned);
+}
+
+
+// --- Parallel Batches ---
+// One compiled program over many inputs. Threads claim the next job with an
+// atomic increment of a shared cursor, so there is no lock and no per-job
+// handoff; each run's tape comes from its thread's arena, which is recycled
+// from job to job. The jobs are set up before the threads start and read
+// after they are joined, so the cursor needs no ordering of its own.
+// Lockstep batches claim a group of LOCKSTEP_LANES jobs at a time.
+// Cancellation: only the calling thread calls cancel_poll (in Wasm the hook
+// lives in that thread's function table). When it fires, the calling thread
+// raises cancel_flag, which every thread polls, and jobs not started yet are
+// failed with BF_ERR_CANCELLED.
+typedef struct {
+    const BrainfuckProgram *program;
+    BfvmBatchJob *jobs;
+    size_t job_count;
+    size_t mem_size;
+    int engine_flags;
+    size_t claim;               // Jobs taken per claim
+    size_t next;                // Next unclaimed job (atomic)
+    int running;                // Worker threads still draining (atomic)
+} BatchQueue;
+
+static void batch_cancel_jobs(BfvmBatchJob *jobs, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        memset(&jobs[k].result, 0, sizeof(BfvmResult));
+        jobs[k].result.error = BF_ERR_CANCELLED;
+    }
+}
+
+static int batch_any_cancelled(const BfvmBatchJob *jobs, size_t count) {
+    for (size_t k = 0; k < count; ++k) {
+        if (jobs[k].result.error == BF_ERR_CANCELLED) return 1;
+    }
+    return 0;
+}
+
+static void batch_drain(BatchQueue *queue, intptr_t cancel_poll) {
+    size_t k;
+    while ((k = __atomic_fetch_add(&queue->next, queue->claim, __ATOMIC_RELAXED)) < queue->job_count) {
+        size_t count = queue->job_count - k < queue->claim ? queue->job_count - k : queue->claim;
+        if (cancel_flag != 0) {
+            batch_cancel_jobs(queue->jobs + k, count);
+            continue;
+        }
+        if (count > 1) {
+            run_lockstep(queue->program, queue->jobs + k, count, queue->mem_size, queue->engine_flags, cancel_poll);
+        } else {
+            BfvmBatchJob *job = &queue->jobs[k];
+            bfvm_run_program_ex(queue->program, job->input, job->in_len, job->out_buf, job->out_len_max,
+                                queue->mem_size, 0, 0, queue->engine_flags & ~BFVM_ENGINE_LOCKSTEP, cancel_poll,
+                                &job->result);
+        }
+        // A cancel seen through the hook stops the other threads too
+        if (cancel_poll && batch_any_cancelled(queue->jobs + k, count)) cancel_flag = 1;
+    }
+}
+
+#ifdef BFVM_HAVE_THREADS
+static void *batch_worker(void *arg) {
+    BatchQueue *queue = (BatchQueue*)arg;
+    batch_drain(queue, 0);
+    arena_release();
+    __atomic_fetch_sub(&queue->running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// The calling thread, out of jobs, keeps polling for the threads still running
+static void batch_wait(BatchQueue *queue, intptr_t cancel_poll) {
+    const struct timespec pause = { 0, BATCH_POLL_NS };
+    while (__atomic_load_n(&queue->running, __ATOMIC_ACQUIRE) > 0) {
+        if (cancel_flag == 0 && ((cancel_poll_t)cancel_poll)()) cancel_flag = 1;
+        nanosleep(&pause, NULL);
+    }
+}
+#endif
+
+EMSCRIPTEN_KEEPALIVE
+int bfvm_batch_run(const BrainfuckProgram *program, BfvmBatchJob *jobs, size_t job_count,
+                   size_t mem_size, int engine_flags, int threads, intptr_t cancel_poll) {
+    if (!program || (!jobs && job_count > 0) || mem_size == 0) return BF_ERR_INVALID_ARGS;
+    int lockstep = engine_flags & BFVM_ENGINE_LOCKSTEP;
+    BatchQueue queue = { program, jobs, job_count, mem_size, engine_flags, lockstep ? LOCKSTEP_LANES : 1, 0, 0 };
+    size_t claims = (job_count + queue.claim - 1) / queue.claim;
+
+#ifdef BFVM_HAVE_THREADS
+    pthread_t workers[BATCH_MAX_THREADS - 1];
+    int started = 0;
+    if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+    if ((size_t)threads > claims) threads = (int)claims;
+    // A thread that fails to start just leaves its share to the others
+    while (started < threads - 1) {
+        __atomic_fetch_add(&queue.running, 1, __ATOMIC_RELAXED);
+        if (pthread_create(&workers[started], NULL, batch_worker, &queue) != 0) {
+            __atomic_fetch_sub(&queue.running, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        started++;
+    }
+    batch_drain(&queue, cancel_poll); // The calling thread works too
+    if (cancel_poll) batch_wait(&queue, cancel_poll);
+    for (int k = 0; k < started; ++k) pthread_join(workers[k], NULL);
+#else
+    (void)threads;
+    (void)claims;
+    batch_drain(&queue, cancel_poll);
+#endif
+    return BF_SUCCESS;
+}
+
+
+// --- Error Messages ---
+EMSCRIPTEN_KEEPALIVE
+const char *bfvm_strerror(int error_code) {
+    switch (error_code) {
+        case BF_SUCCESS: return "Success.";
+        case BF_ERR_MEMORY_OUT_OF_BOUNDS: return "Memory Out Of Bounds: Data pointer moved beyond tape limits.";
+        case BF_ERR_INPUT_EOF: return "Input EOF.";
+        case BF_ERR_OUTPUT_OVERFLOW: return "Output Overflow: Output buffer is full.";
+        case BF_ERR_UNMATCHED_BRACKET_CLOSE: return "Syntax Error: Unmatched closing bracket ']' (detected in pre-scan).";
+        case BF_ERR_UNMATCHED_BRACKET_OPEN: return "Syntax Error: Unmatched opening bracket '[' (detected in pre-scan).";
+        case BF_ERR_TAPE_ALLOC_FAILED: return "Memory Allocation Failed: Could not allocate Brainfuck memory tape.";
+        case BF_ERR_JUMPTABLE_ALLOC_FAILED: return "Internal Error: Failed to allocate jump table.";
+        case BF_ERR_STACK_OVERFLOW: return "Syntax Error: Bracket nesting depth exceeded limit.";
+        case BF_ERR_DEBUG_HALT_REQUESTED: return "Execution Halted by Debugger.";
+        case BF_ERR_INVALID_ARGS: return "Internal Error: Invalid arguments.";
+        case BF_ERR_BREAKPOINT_ALLOC_FAILED: return "Internal Error: Failed to allocate breakpoint buffer.";
+        case BF_ERR_INFINITE_LOOP: return "Runtime Error: Infinite loop detected (loop state repeated).";
+        case BF_ERR_CANCELLED: return "Execution Cancelled.";
+        case BF_ERR_RESULT_OVERFLOW: return "Internal Error: Output length exceeds the 32-bit result.";
+        case BF_ERR_OUTPUT_WRITE_FAILED: return "Output Error: The host write callback failed.";
+        case BF_ERR_WATCHPOINT_HIT: return "Stopped at a watchpoint.";
+        default: return "Unknown error code.";
+    }
+}
+
+
 // --- Wasm Memory Management Helpers ---
 EMSCRIPTEN_KEEPALIVE void* bfvm_mem_alloc(size_t size) { return malloc(size); }
 EMSCRIPTEN_KEEPALIVE void bfvm_mem_free(void* ptr) { free(ptr); }
\ No newline at end of file
@@ -0,0 +1,253 @@
+// bfvm.h - C API OF THE BRAINFUCK VM (libbfvm)
+//
+// The same core backs the Wasm module used by lib/index.js and the native
+// static/shared libraries built by the top-level Makefile (`make native`).
+// Native hosts link libbfvm and use either the one-shot entry points
+// (bfvm_run_ex) or compiled programs plus instances, which stream I/O
+// through callbacks and can be run in bounded steps.
+//
+// Threads: runs on different threads are independent (each thread has its
+// own run arena), and bfvm_batch_run spreads one program over threads. An
+// instance must only be used by one thread at a time, and bfvm_set_allocator
+// must be called before any other thread uses the VM. The cancel flag is
+// process-wide.
+
+#ifndef BFVM_H
+#define BFVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// --- Error Codes --- (Add new codes)
+#define BF_SUCCESS 0
+#define BF_ERR_MEMORY_OUT_OF_BOUNDS -1
+#define BF_ERR_INPUT_EOF -2
+#define BF_ERR_OUTPUT_OVERFLOW -3
+#define BF_ERR_UNMATCHED_BRACKET_CLOSE -4 // Now primarily detected during pre-scan
+#define BF_ERR_UNMATCHED_BRACKET_OPEN -5  // Now primarily detected during pre-scan
+#define BF_ERR_TAPE_ALLOC_FAILED -6
+#define BF_ERR_JUMPTABLE_ALLOC_FAILED -7 // New
+#define BF_ERR_STACK_OVERFLOW -8        // New (for pre-scan)
+#define BF_ERR_DEBUG_HALT_REQUESTED -9 // New signal from debug callback
+#define BF_ERR_INVALID_ARGS -10
+#define BF_ERR_BREAKPOINT_ALLOC_FAILED -11 // New
+#define BF_ERR_INFINITE_LOOP -12          // Hang detector saw a loop state repeat
+#define BF_ERR_CANCELLED -13              // Cancel flag or poll hook asked the run to stop
+#define BF_ERR_RESULT_OVERFLOW -14        // Output length doesn't fit the int result; use the *_ex entry points
+#define BF_ERR_OUTPUT_WRITE_FAILED -15    // The host's write callback reported an error
+#define BF_ERR_WATCHPOINT_HIT -16         // bfvm_run_program_watch: a watchpoint matched (see the BfvmWatchHit)
+
+#define BFVM_PAUSED 1 // bfvm_instance_step/slice: budget used up, call again to continue
+
+// --- Engine Flags (bfvm_run engine_flags) ---
+#define BFVM_ENGINE_TRACE 0x1       // Record hot loops into guarded straight-line traces
+#define BFVM_ENGINE_CACHE_CELLS 0x2 // With TRACE: balanced traces keep their cells in a register
+#define BFVM_ENGINE_HANG_DETECT 0x4 // Fail fast on provably infinite loops (disables TRACE)
+#define BFVM_ENGINE_LOCKSTEP 0x8    // bfvm_batch_run: run jobs in SIMD lane groups (ignored elsewhere)
+
+#define BFVM_DEFAULT_IO_BUFFER_SIZE (64 * 1024)
+
+// --- Hook Types ---
+// Debug hook: called before each instruction when single stepping; return
+// non-zero to halt. Cancel poll: return non-zero to cancel the run.
+typedef int (*bfvm_debug_hook_t)(size_t ip, size_t dp, uint8_t current_cell_value);
+typedef int (*bfvm_cancel_poll_t)(void);
+
+// --- Run Result (bfvm_run_ex / bfvm_run_program_ex) ---
+// Counters are 64-bit whatever the pointer width, so the memory64 and native
+// builds report tapes and outputs past 2-4 GB exactly (bfvm_run's int result
+// can't hold those). Layout is fixed for hosts reading it from the heap.
+// `ops` counts taken loop back-edges (iterations of hot loops that run as
+// traces included; loops run in closed form count none), the unit of
+// bfvm_instance_slice budgets.
+typedef struct {
+    uint64_t output_len;        // Bytes written to out_buf (or through BfvmIO.write)
+    uint64_t input_read;        // Input bytes consumed by ','
+    uint64_t data_pointer;      // Final dp (where the run stopped on errors)
+    int32_t error;              // BF_SUCCESS or BF_ERR_*
+    int32_t reserved;
+    uint64_t ops;               // Back-edges taken
+} BfvmResult;
+
+// --- Allocator Hooks ---
+// Everything the VM allocates (programs, instances, tapes, the per-run arena)
+// goes through these. Set them before any other call; NULL restores malloc.
+typedef struct {
+    void *(*alloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} BfvmAllocator;
+
+void bfvm_set_allocator(const BfvmAllocator *allocator);
+
+// --- Host I/O (instances) ---
+// `read` fills up to `capacity` bytes and returns how many it wrote (0 = end
+// of input for this ','; it is asked again on the next one). `write` gets
+// the buffered output when the buffer is full and when a run or step call
+// returns; a non-zero return fails the run with BF_ERR_OUTPUT_WRITE_FAILED.
+// Without `read`, ',' sees EOF (0); without `write`, output is discarded
+// (result->output_len still counts it).
+typedef struct {
+    size_t (*read)(void *user, char *buf, size_t capacity);
+    int (*write)(void *user, const char *buf, size_t len);
+    void *user;
+} BfvmIO;
+
+// --- Compiled Programs ---
+// Jump table and loop analysis, computed once and shared read-only by runs.
+typedef struct BrainfuckProgram BrainfuckProgram;
+
+// Compiles a copy of `code`. Returns NULL and stores the BF_ERR_* code in
+// *error_out (if given) on failure.
+BrainfuckProgram *bfvm_compile(const char *code, size_t code_len, int *error_out);
+// Same, but borrows `code` (e.g. an mmap'd file), which must outlive the program.
+BrainfuckProgram *bfvm_compile_view(const char *code, size_t code_len, int *error_out);
+void bfvm_program_free(BrainfuckProgram *program);
+
+// --- Instances ---
+// A tape and run state for one program (which must outlive it). Runs can be
+// driven to completion or in steps; a step is one dispatch of the
+// interpreter (a folded run of + - < >, one I/O or bracket instruction, or a
+// whole loop the engine runs in closed form). Stepping runs on the
+// interpreter tier; bfvm_instance_run uses traces when enabled.
+typedef struct {
+    size_t memory_size;         // Tape cells (must be non-zero)
+    int engine_flags;           // BFVM_ENGINE_* bits
+    BfvmIO io;
+    size_t io_buffer_size;      // Input and output buffer size (0 = BFVM_DEFAULT_IO_BUFFER_SIZE)
+} BfvmConfig;
+
+typedef struct BfvmInstance BfvmInstance;
+
+BfvmInstance *bfvm_instance_create(const BrainfuckProgram *program, const BfvmConfig *config, int *error_out);
+// Run to the end. Returns BF_SUCCESS or BF_ERR_*; `result` (may be NULL)
+// has the totals so far. A finished instance keeps returning its result.
+int bfvm_instance_run(BfvmInstance *instance, BfvmResult *result);
+// Run at most `max_steps` steps. Returns BFVM_PAUSED if the program hasn't
+// finished, otherwise as bfvm_instance_run.
+int bfvm_instance_step(BfvmInstance *instance, uint64_t max_steps, BfvmResult *result);
+// Run on the full engine (traces included) for about `max_ops` ops (see
+// BfvmResult), pausing at a loop back-edge: returns BFVM_PAUSED if the
+// program hasn't finished, otherwise as bfvm_instance_run. Lets a host
+// time-slice many instances on one thread.
+int bfvm_instance_slice(BfvmInstance *instance, size_t max_ops, BfvmResult *result);
+// The tape (valid until the instance is freed) and the next instruction.
+uint8_t *bfvm_instance_tape(BfvmInstance *instance, size_t *size, size_t *ip, size_t *dp);
+void bfvm_instance_free(BfvmInstance *instance);
+
+// --- One-Shot Runs ---
+// Output goes to `out_buf` (NUL-terminated if there is room). The *_ex
+// variants return BF_SUCCESS or BF_ERR_* and fill `result`; the int variants
+// return the output length or BF_ERR_*. Hook pointers are bfvm_debug_hook_t
+// and bfvm_cancel_poll_t cast to intptr_t (0 = none).
+int bfvm_run_ex(const char *code, size_t code_len, const char *input, size_t in_len,
+                char *out_buf, size_t out_len_max, size_t mem_size,
+                intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll,
+                BfvmResult *result);
+int bfvm_run_program_ex(const BrainfuckProgram *program, const char *input, size_t in_len,
+                        char *out_buf, size_t out_len_max, size_t mem_size,
+                        intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll,
+                        BfvmResult *result);
+// Same as bfvm_run_program_ex, but on the caller's `tape` of `mem_size` cells:
+// it is used as it is (not cleared) and holds the final state when the call
+// returns, so the host (or its debug hook, during the run) can inspect it in
+// place. A host can also preload it (data the program would otherwise lay
+// out with ',' loops) and start past that prologue at `start_ip`, with the
+// data pointer at `start_dp` (BF_ERR_INVALID_ARGS if either is out of range).
+int bfvm_run_program_tape(const BrainfuckProgram *program, uint8_t *tape, size_t start_ip, size_t start_dp,
+                          const char *input, size_t in_len,
+                          char *out_buf, size_t out_len_max, size_t mem_size,
+                          intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll,
+                          BfvmResult *result);
+
+// --- Watchpoints ---
+// bfvm_run_program_watch runs like bfvm_run_program_tape on an interpreter
+// variant that checks every cell access against a bitmap of the watched
+// cells, and stops with BF_ERR_WATCHPOINT_HIT after the first access a
+// watchpoint matches, filling `hit`. Reads are '.' and the '[' / ']' tests;
+// writes are '+', '-' (a folded run counts once, at its first instruction)
+// and ','. Loops the engine would run in closed form are interpreted when
+// they can touch a watched cell. Runs at interpreter speed: no traces, and
+// BFVM_ENGINE_HANG_DETECT is ignored. `tape` may be NULL (a cleared tape of
+// mem_size cells). Layouts are fixed, like BfvmResult.
+#define BFVM_WATCH_READ 0x1
+#define BFVM_WATCH_WRITE 0x2
+#define BFVM_WATCH_CHANGE 0x4       // A write that changes the value
+
+typedef struct {
+    uint64_t first;             // First cell watched
+    uint64_t count;             // Cells watched
+    int32_t kinds;              // BFVM_WATCH_* bits
+    int32_t reserved;
+} BfvmWatchpoint;
+
+typedef struct {
+    uint64_t ip;                // Instruction that made the access
+    uint64_t cell;
+    int32_t watchpoint;         // Index of the watchpoint that matched
+    int32_t kind;               // BFVM_WATCH_* it matched as (CHANGE over WRITE)
+    uint8_t old_value;          // Cell before and after the instruction
+    uint8_t new_value;
+} BfvmWatchHit;
+
+int bfvm_run_program_watch(const BrainfuckProgram *program, uint8_t *tape, size_t start_ip, size_t start_dp,
+                           const BfvmWatchpoint *watchpoints, size_t watch_count, BfvmWatchHit *hit,
+                           const char *input, size_t in_len, char *out_buf, size_t out_len_max, size_t mem_size,
+                           intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll,
+                           BfvmResult *result);
+
+int bfvm_run(const char *code, size_t code_len, const char *input, size_t in_len,
+             char *out_buf, size_t out_len_max, size_t mem_size,
+             intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll);
+int bfvm_run_program(const BrainfuckProgram *program, const char *input, size_t in_len,
+                     char *out_buf, size_t out_len_max, size_t mem_size,
+                     intptr_t debug_hook, int single_step, int engine_flags, intptr_t cancel_poll);
+
+// --- Parallel Batches ---
+// Runs one program over many inputs on up to `threads` threads (the calling
+// thread included) and returns when all jobs are done. Each job gets a fresh
+// tape of `mem_size` cells and its own output buffer, like bfvm_run_program_ex;
+// its outcome is in job->result. Returns BF_ERR_INVALID_ARGS for bad
+// arguments, otherwise BF_SUCCESS. Builds without threads (the default Wasm
+// build) run the jobs one after another.
+// With BFVM_ENGINE_LOCKSTEP, groups of 16 jobs (32 with AVX2) run in lockstep
+// in SIMD lanes, each instruction once for the whole group. Lanes whose
+// control flow departs from the group's continue on their own, so results
+// are the same as without the flag; it pays off when the inputs take the
+// same path through the program (e.g. grading one program on many inputs).
+// BFVM_ENGINE_HANG_DETECT applies to the group as a whole and to the lanes
+// that leave it.
+// cancel_poll (a bfvm_cancel_poll_t, 0 = none) is called by the calling
+// thread only: at its own runs' back-edges and, once it has no jobs left,
+// about every millisecond while the other threads finish. When it fires,
+// bfvm_cancel_flag() is raised so every thread stops; running and unstarted
+// jobs end with BF_ERR_CANCELLED. Clear the flag before the next run.
+typedef struct {
+    const char *input;
+    size_t in_len;
+    char *out_buf;
+    size_t out_len_max;
+    BfvmResult result;          // Filled in by the run
+} BfvmBatchJob;
+
+int bfvm_batch_run(const BrainfuckProgram *program, BfvmBatchJob *jobs, size_t job_count,
+                   size_t mem_size, int engine_flags, int threads, intptr_t cancel_poll);
+
+// --- Cancellation ---
+// Process-wide flag polled at loop back-edges; non-zero cancels running and
+// later runs with BF_ERR_CANCELLED until cleared.
+volatile int32_t *bfvm_cancel_flag(void);
+
+// Message for a BF_ERR_* code (static string).
+const char *bfvm_strerror(int error_code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BFVM_H
@@ -0,0 +1,184 @@
+// bfvm_addon.c - NODE-API ADDON (runs the core on the libuv threadpool)
+//
+// run(code, input, output, memorySize, engineFlags, cancel) -> Promise<[code, outputLength, inputRead, durationMs]>
+//
+// code, input and output are Buffers (or other Uint8Array views) used in
+// place: the worker thread reads code/input and writes output directly into
+// the JS memory, which is kept alive by references until the promise
+// settles. `cancel` is an optional Int32Array; a non-zero element 0 cancels
+// the run at the next poll. lib/native.js wraps this into executeNative().
+
+#define NAPI_VERSION 8
+#include <node_api.h>
+#include <uv.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bfvm.h"
+
+#define NAPI_CALL(env, call)                                                \
+    do {                                                                    \
+        if ((call) != napi_ok) {                                            \
+            const napi_extended_error_info *info = NULL;                    \
+            napi_get_last_error_info((env), &info);                         \
+            bool pending = false;                                           \
+            napi_is_exception_pending((env), &pending);                     \
+            if (!pending) {                                                 \
+                napi_throw_error((env), NULL, info && info->error_message   \
+                                 ? info->error_message : "Node-API call failed"); \
+            }                                                               \
+            return NULL;                                                    \
+        }                                                                   \
+    } while (0)
+
+// --- Job State ---
+// Created on the main thread, executed on a threadpool thread, completed and
+// freed on the main thread.
+typedef struct {
+    napi_async_work work;
+    napi_deferred deferred;
+    napi_ref refs[4];               // code, input, output, cancel (while the job runs)
+    size_t ref_count;
+
+    const char *code;
+    size_t code_len;
+    const char *input;
+    size_t input_len;
+    char *output;
+    size_t output_max;
+    size_t memory_size;
+    int engine_flags;
+    int32_t *cancel;                // Element 0 of the cancel Int32Array (NULL = none)
+
+    int result_code;
+    BfvmResult result;
+    double duration_ms;
+} Job;
+
+// --- Cancellation ---
+// The core's poll hook takes no arguments, so the job a thread is running is
+// found through a thread-local.
+static _Thread_local const Job *current_job = NULL;
+
+static int poll_job_cancel(void) {
+    return current_job && current_job->cancel && __atomic_load_n(current_job->cancel, __ATOMIC_RELAXED) != 0;
+}
+
+// --- Worker Thread ---
+static void execute_job(napi_env env, void *data) {
+    (void)env; // No Node-API calls off the main thread
+    Job *job = (Job*)data;
+    uint64_t start = uv_hrtime();
+
+    current_job = job;
+    job->result_code = bfvm_run_ex(job->code, job->code_len, job->input, job->input_len,
+                                   job->output, job->output_max, job->memory_size,
+                                   0, 0, job->engine_flags, (intptr_t)poll_job_cancel, &job->result);
+    current_job = NULL;
+    job->duration_ms = (double)(uv_hrtime() - start) / 1e6;
+}
+
+// --- Main Thread ---
+static void free_job(napi_env env, Job *job) {
+    for (size_t k = 0; k < job->ref_count; ++k) napi_delete_reference(env, job->refs[k]);
+    if (job->work) napi_delete_async_work(env, job->work);
+    free(job);
+}
+
+static void complete_job(napi_env env, napi_status status, void *data) {
+    Job *job = (Job*)data;
+    napi_value values[4], result;
+
+    if (status != napi_ok) {
+        napi_value message, error;
+        napi_create_string_utf8(env, "Brainfuck VM job was cancelled before it ran.", NAPI_AUTO_LENGTH, &message);
+        napi_create_error(env, NULL, message, &error);
+        napi_reject_deferred(env, job->deferred, error);
+    } else {
+        napi_create_int32(env, job->result_code, &values[0]);
+        napi_create_double(env, (double)job->result.output_len, &values[1]);
+        napi_create_double(env, (double)job->result.input_read, &values[2]);
+        napi_create_double(env, job->duration_ms, &values[3]);
+        napi_create_array_with_length(env, 4, &result);
+        for (uint32_t k = 0; k < 4; ++k) napi_set_element(env, result, k, values[k]);
+        napi_resolve_deferred(env, job->deferred, result);
+    }
+    free_job(env, job);
+}
+
+// Gets the bytes of a Uint8Array/Buffer argument and keeps it alive for the job
+static int hold_bytes(napi_env env, Job *job, napi_value value, void **data, size_t *length) {
+    bool is_typedarray = false;
+    napi_typedarray_type type;
+    napi_value arraybuffer;
+    size_t offset;
+
+    if (napi_is_typedarray(env, value, &is_typedarray) != napi_ok || !is_typedarray) return 0;
+    if (napi_get_typedarray_info(env, value, &type, length, data, &arraybuffer, &offset) != napi_ok) return 0;
+    if (type != napi_uint8_array && type != napi_int32_array) return 0;
+    if (type == napi_int32_array) *length *= sizeof(int32_t);
+    return napi_create_reference(env, value, 1, &job->refs[job->ref_count++]) == napi_ok;
+}
+
+static napi_value run(napi_env env, napi_callback_info info) {
+    size_t argc = 6;
+    napi_value argv[6], promise, resource_name;
+    void *code, *input, *output, *cancel = NULL;
+    size_t code_len, input_len, output_max, cancel_len = 0;
+    double memory_size;
+    int32_t engine_flags;
+    napi_valuetype cancel_type = napi_undefined;
+
+    NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, NULL, NULL));
+    if (argc < 5) {
+        napi_throw_type_error(env, NULL, "run(code, input, output, memorySize, engineFlags[, cancel]) expects 5-6 arguments.");
+        return NULL;
+    }
+    if (argc > 5) NAPI_CALL(env, napi_typeof(env, argv[5], &cancel_type));
+
+    Job *job = (Job*)calloc(1, sizeof(Job));
+    if (!job) {
+        napi_throw_error(env, NULL, "Failed to allocate Brainfuck VM job.");
+        return NULL;
+    }
+    if (!hold_bytes(env, job, argv[0], &code, &code_len) ||
+        !hold_bytes(env, job, argv[1], &input, &input_len) ||
+        !hold_bytes(env, job, argv[2], &output, &output_max) ||
+        (cancel_type != napi_undefined && (!hold_bytes(env, job, argv[5], &cancel, &cancel_len) || cancel_len < 4)) ||
+        napi_get_value_double(env, argv[3], &memory_size) != napi_ok ||
+        napi_get_value_int32(env, argv[4], &engine_flags) != napi_ok) {
+        free_job(env, job);
+        napi_throw_type_error(env, NULL, "Invalid arguments: expected Uint8Arrays, numbers and an optional Int32Array.");
+        return NULL;
+    }
+    job->code = code ? (const char*)code : ""; // Empty views may have no data pointer
+    job->code_len = code_len;
+    job->input = input ? (const char*)input : "";
+    job->input_len = input_len;
+    job->output = (char*)output;
+    job->output_max = output ? output_max : 0;
+    job->memory_size = memory_size > 0 ? (size_t)memory_size : 0;
+    job->engine_flags = engine_flags;
+    job->cancel = (int32_t*)cancel;
+
+    if (napi_create_promise(env, &job->deferred, &promise) != napi_ok ||
+        napi_create_string_utf8(env, "bfvm:run", NAPI_AUTO_LENGTH, &resource_name) != napi_ok ||
+        napi_create_async_work(env, NULL, resource_name, execute_job, complete_job, job, &job->work) != napi_ok ||
+        napi_queue_async_work(env, job->work) != napi_ok) {
+        free_job(env, job); // A created promise is simply never settled
+        napi_throw_error(env, NULL, "Failed to queue Brainfuck VM job.");
+        return NULL;
+    }
+    return promise;
+}
+
+static napi_value init(napi_env env, napi_value exports) {
+    napi_value fn;
+    NAPI_CALL(env, napi_create_function(env, "run", NAPI_AUTO_LENGTH, run, NULL, &fn));
+    NAPI_CALL(env, napi_set_named_property(env, exports, "run", fn));
+    return exports;
+}
+
+NAPI_MODULE_INIT() {
+    return init(env, exports);
+}
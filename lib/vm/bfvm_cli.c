@@ -0,0 +1,242 @@
+// bfvm_cli.c - STANDALONE COMMAND-LINE RUNNER (make cli -> build/bfvm)
+//
+//   bfvm [options] program.bf < input > output
+//
+// The source file is mmap'd and compiled in place; stdin and stdout stream
+// through the instance's I/O buffers, so inputs and outputs of any size run
+// in constant memory.
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bfvm.h"
+
+#define DEFAULT_MEMORY_SIZE 30000
+#define PROFILE_INTERVAL 1024   // Dispatches between profile samples
+#define PROFILE_TOP 10          // Hottest instructions listed
+#define PROFILE_SNIPPET 24      // Source characters shown per entry
+
+static const char usage[] =
+    "Usage: bfvm [options] program.bf\n"
+    "Runs a Brainfuck program, reading stdin and writing stdout.\n"
+    "\n"
+    "  -e, --engine NAME    trace (default), trace-cached or interpreter\n"
+    "  -m, --memory CELLS   Tape size (default 30000)\n"
+    "  -b, --buffer BYTES   Input/output buffer size (default 65536)\n"
+    "      --detect-hangs   Fail on provably infinite loops\n"
+    "  -s, --stats          Print run statistics to stderr\n"
+    "  -p, --profile        Print the hottest instructions to stderr (interpreter only)\n"
+    "  -h, --help           Show this help\n";
+
+// --- Streaming I/O Callbacks ---
+typedef struct {
+    int read_errno;             // Set when stdin failed (the program sees EOF)
+} CliIO;
+
+static size_t read_stdin(void *user, char *buf, size_t capacity) {
+    CliIO *io = (CliIO*)user;
+    for (;;) {
+        ssize_t got = read(STDIN_FILENO, buf, capacity);
+        if (got >= 0) return (size_t)got;
+        if (errno != EINTR) {
+            io->read_errno = errno;
+            return 0;
+        }
+    }
+}
+
+static int write_stdout(void *user, const char *buf, size_t len) {
+    (void)user;
+    while (len > 0) {
+        ssize_t put = write(STDOUT_FILENO, buf, len);
+        if (put < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        buf += put;
+        len -= (size_t)put;
+    }
+    return 0;
+}
+
+// --- Option Parsing ---
+static int parse_size(const char *text, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno || end == text || *end || value == 0 || value > SIZE_MAX) return 0;
+    *out = (size_t)value;
+    return 1;
+}
+
+static int engine_flags_for(const char *name, int *flags) {
+    if (strcmp(name, "interpreter") == 0) *flags = 0;
+    else if (strcmp(name, "trace") == 0) *flags = BFVM_ENGINE_TRACE;
+    else if (strcmp(name, "trace-cached") == 0) *flags = BFVM_ENGINE_TRACE | BFVM_ENGINE_CACHE_CELLS;
+    else return 0;
+    return 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// --- Profiling ---
+// Sampling on the step API: every PROFILE_INTERVAL dispatches the instance
+// pauses and the next instruction is counted.
+static int run_profiled(BfvmInstance *vm, const char *code, size_t code_len, BfvmResult *result) {
+    uint64_t *samples = (uint64_t*)calloc(code_len ? code_len : 1, sizeof(uint64_t));
+    uint64_t total = 0;
+    size_t ip;
+    int rc;
+
+    if (!samples) return bfvm_instance_run(vm, result);
+    while ((rc = bfvm_instance_step(vm, PROFILE_INTERVAL, result)) == BFVM_PAUSED) {
+        bfvm_instance_tape(vm, NULL, &ip, NULL);
+        if (ip < code_len) {
+            samples[ip]++;
+            total++;
+        }
+    }
+
+    fprintf(stderr, "bfvm: profile (%llu samples, every %d dispatches)\n", (unsigned long long)total, PROFILE_INTERVAL);
+    for (int rank = 0; rank < PROFILE_TOP && total > 0; ++rank) {
+        size_t best = 0;
+        for (size_t k = 1; k < code_len; ++k) {
+            if (samples[k] > samples[best]) best = k;
+        }
+        if (samples[best] == 0) break;
+        char snippet[PROFILE_SNIPPET + 1];
+        size_t n = 0;
+        for (size_t k = best; k < code_len && n < PROFILE_SNIPPET; ++k) {
+            if (strchr("+-<>[].,", code[k])) snippet[n++] = code[k];
+        }
+        snippet[n] = '\0';
+        fprintf(stderr, "  %5.1f%%  ip %-8zu %s\n", 100.0 * (double)samples[best] / (double)total, best, snippet);
+        samples[best] = 0;
+    }
+    free(samples);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    const char *engine = "trace";
+    size_t memory_size = DEFAULT_MEMORY_SIZE;
+    size_t buffer_size = BFVM_DEFAULT_IO_BUFFER_SIZE;
+    int engine_flags = BFVM_ENGINE_TRACE;
+    int detect_hangs = 0, stats = 0, profile = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
+            fputs(usage, stdout);
+            return 0;
+        } else if (!strcmp(arg, "-e") || !strcmp(arg, "--engine")) {
+            if (!value || !engine_flags_for(value, &engine_flags)) {
+                fprintf(stderr, "bfvm: --engine must be trace, trace-cached or interpreter\n");
+                return 2;
+            }
+            engine = value;
+            i++;
+        } else if (!strcmp(arg, "-m") || !strcmp(arg, "--memory")) {
+            if (!value || !parse_size(value, &memory_size)) {
+                fprintf(stderr, "bfvm: --memory must be a positive number of cells\n");
+                return 2;
+            }
+            i++;
+        } else if (!strcmp(arg, "-b") || !strcmp(arg, "--buffer")) {
+            if (!value || !parse_size(value, &buffer_size)) {
+                fprintf(stderr, "bfvm: --buffer must be a positive number of bytes\n");
+                return 2;
+            }
+            i++;
+        } else if (!strcmp(arg, "--detect-hangs")) {
+            detect_hangs = 1;
+        } else if (!strcmp(arg, "-s") || !strcmp(arg, "--stats")) {
+            stats = 1;
+        } else if (!strcmp(arg, "-p") || !strcmp(arg, "--profile")) {
+            profile = 1;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "bfvm: unknown option %s\n%s", arg, usage);
+            return 2;
+        } else if (!path) {
+            path = arg;
+        } else {
+            fprintf(stderr, "bfvm: only one program file may be given\n");
+            return 2;
+        }
+    }
+    if (!path) {
+        fputs(usage, stderr);
+        return 2;
+    }
+    if (detect_hangs) engine_flags = BFVM_ENGINE_HANG_DETECT;
+
+    // --- Map the Source ---
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "bfvm: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    size_t code_len = (size_t)st.st_size;
+    const char *code = "";
+    if (code_len > 0) {
+        void *mapped = mmap(NULL, code_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            fprintf(stderr, "bfvm: %s: %s\n", path, strerror(errno));
+            close(fd);
+            return 1;
+        }
+        code = (const char*)mapped;
+    }
+    close(fd); // The mapping stays valid
+
+    int error = BF_SUCCESS;
+    BrainfuckProgram *program = bfvm_compile_view(code, code_len, &error);
+    if (!program) {
+        fprintf(stderr, "bfvm: %s: %s\n", path, bfvm_strerror(error));
+        return 1;
+    }
+
+    CliIO io_state = { 0 };
+    BfvmConfig config = { memory_size, engine_flags, { read_stdin, write_stdout, &io_state }, buffer_size };
+    BfvmInstance *vm = bfvm_instance_create(program, &config, &error);
+    if (!vm) {
+        fprintf(stderr, "bfvm: %s\n", bfvm_strerror(error));
+        bfvm_program_free(program);
+        return 1;
+    }
+
+    // --- Run ---
+    BfvmResult result;
+    double start = now_seconds();
+    int rc = profile ? run_profiled(vm, code, code_len, &result) : bfvm_instance_run(vm, &result);
+    double elapsed = now_seconds() - start;
+
+    if (rc != BF_SUCCESS) fprintf(stderr, "bfvm: %s (Code: %d)\n", bfvm_strerror(rc), rc);
+    if (io_state.read_errno) fprintf(stderr, "bfvm: reading stdin: %s\n", strerror(io_state.read_errno));
+    if (stats) {
+        fprintf(stderr, "bfvm: %.3f ms, engine %s, output %llu bytes, input %llu bytes, dp %llu of %zu, %llu ops\n",
+                elapsed * 1e3, detect_hangs ? "interpreter (hang detection)" : profile ? "interpreter (profiling)" : engine,
+                (unsigned long long)result.output_len, (unsigned long long)result.input_read,
+                (unsigned long long)result.data_pointer, memory_size, (unsigned long long)result.ops);
+    }
+
+    bfvm_instance_free(vm);
+    bfvm_program_free(program);
+    if (code_len > 0) munmap((void*)code, code_len);
+    return rc == BF_SUCCESS ? 0 : 1;
+}
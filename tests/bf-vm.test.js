@@ -3,8 +3,10 @@
 const chalk = require('chalk');
 const path = require('path');
 const readline = require('readline'); // For interactive debugging example
+const assert = require('assert');
+const { Worker } = require('worker_threads');
 
-const { execute, DEFAULT_MEMORY_SIZE } = require('../lib/index.js');
+const { execute, executeSync, executeRecords, executeBatch, executeNative, nativeAvailable, createScheduler, prewarm, DEFAULT_MEMORY_SIZE, ResultCache, QuotaManager } = require('../lib/index.js');
 
 // --- Test Cases ---
 const helloWorldCode = "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.>---.+++++++..+++.>>.<-.<.+++.------.--------.>>+.>++.";
@@ -13,6 +15,12 @@ const memoryTestCode = ">>++++++[<++++++++>-]<.";
 const badCodeUnmatchedOpen = "+++[>+.";
 const badCodeOOB = "<";
 const simpleLoopCode = "++[>+<-]"; // Simple loop for debugging
+const closedFormLoopCode = "++++++++++[-->+++++++++++++<]>.>+++++[--->+<]>."; // Non-unit steps, expect "AW"
+const nestedLoopCode = "+++++++[>+++++++++<-]>>++++++++++<[>[->+>+<<]>[-<+>]<<-]>>>."; // 63*10 mod 256, expect "v"
+// 200 divmod 7 (>n 0 d -> >0 n d-n%d n%d n/d), printed as '0'+4 and '0'+28, expect "4L"
+const divmodCode = "+".repeat(200) + ">>+++++++<<[->+>-[>+>>]>[+[-<+>]>+>>]<<<<<<]>>>" + "+".repeat(48) + ".>" + "+".repeat(48) + ".";
+const upperCaseLineCode = ",----------[----------------------.,----------]++++++++++."; // Per-line a-z -> A-Z
+const clearRunCode = "++++++++[>++++++++<-]>+>+>+<<[-]+++++++++++++++++++++++++++++++++>[-]++++++++++++++++++++++++++++++++++>[-]+++++++++++++++++++++++++++++++++++<<.>.>."; // Expect "!\"#"
 
 // --- Simple Interactive Debugger --- (Example)
 function createInteractiveDebugger() {
@@ -56,9 +64,51 @@ function createInteractiveDebugger() {
 
 
 // --- Test Runner ---
-async function runTest(title, code, input = '', options = {}) {
+let failures = 0;
+
+// Raises `flag` after `ms` from a worker thread: a run spinning in the VM blocks
+// this thread's timers, but it polls the flag (options.cancelFlag)
+function startTimeout(ms) {
+    const flag = new Int32Array(new SharedArrayBuffer(8));
+    const timer = new Worker(`
+        const { workerData: { flag, ms } } = require('worker_threads');
+        if (Atomics.wait(flag, 1, 0, ms) === 'timed-out') Atomics.store(flag, 0, 1);
+    `, { eval: true, workerData: { flag, ms } });
+    const stop = () => {
+        Atomics.store(flag, 1, 1);
+        Atomics.notify(flag, 1);
+        return timer.terminate();
+    };
+    return { flag, ms, stop };
+}
+
+// Compares a test's result with `expected`: `error` is a VM error code (or an
+// error.code string), other keys are compared with the result's fields
+function check(result, expected) {
+    try {
+        const { error, ...fields } = expected;
+        if (error !== undefined) {
+            assert.ok(result.error, `expected error ${error}, got output ${JSON.stringify(result.output)}`);
+            const match = /\(Code: (-?\d+)\)/.exec(result.error.message);
+            assert.strictEqual(result.error.code ?? (match ? Number(match[1]) : undefined), error, result.error.message);
+        } else if (result.error) {
+            throw result.error;
+        }
+        for (const [key, value] of Object.entries(fields)) {
+            assert.deepStrictEqual(result[key], value, `${key}: expected ${JSON.stringify(value)}, got ${JSON.stringify(result[key])}`);
+        }
+        console.log(chalk.green("PASS"));
+    } catch (error) {
+        failures++;
+        console.log(chalk.red(`FAIL: ${error.message}`));
+    }
+}
+
+async function runTest(title, code, input = '', options = {}, expected = {}) {
     console.log(chalk.blue(`--- ${title} ---`));
     let debuggerInstance = null; // Hold debugger state if created
+    let timeout = null;
+    let result;
 
     try {
         // Special handling for interactive debug test
@@ -70,28 +120,100 @@ async function runTest(title, code, input = '', options = {}) {
             delete options.interactiveDebug; // Remove custom flag
         }
 
-        const { output, duration, memoryStats } = await execute(code, input, options);
+        // A run still going after harnessTimeoutMs is cancelled (and fails with code -13)
+        if (options.harnessTimeoutMs) {
+            timeout = startTimeout(options.harnessTimeoutMs);
+            options = { ...options, cancelFlag: timeout.flag };
+            delete options.harnessTimeoutMs;
+        }
 
-        // Check if debugger requested early exit
-         if (debuggerInstance && debuggerInstance.shouldBreak()) {
-            console.log(chalk.red("Execution was halted by the debugger."));
+        if (options.records) {
+            // Record mode runs the program once per input line via executeRecords()
+            const { records, ...recordOptions } = options;
+            const { output, records: count, duration } = await executeRecords(code, input, recordOptions);
+            console.log(`Input: ${JSON.stringify(input)}`);
+            console.log(`Options: ${JSON.stringify(recordOptions)}`);
+            console.log(`Output: ${JSON.stringify(output)} (${count} records)`);
+            console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
+            result = { output, records: count };
+        } else if (options.batch) {
+            // Batch mode runs the program once per element of an input array via executeBatch()
+            const { batch, ...batchOptions } = options;
+            const { outputs, threads, duration } = await executeBatch(code, input, batchOptions);
+            console.log(`Inputs: ${JSON.stringify(input)}`);
+            console.log(`Outputs: ${JSON.stringify(outputs)} (${threads} thread${threads === 1 ? '' : 's'})`);
+            console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
+            result = { outputs };
+        } else if (options.scheduler) {
+            // Scheduler mode runs the program as an interactive request while batch runs are queued
+            const { scheduler, ...runOptions } = options;
+            const background = [nestedLoopCode, closedFormLoopCode, nestedLoopCode].map(
+                batchCode => scheduler.execute(batchCode, '', { priority: 'batch', tenant: 'bulk' }));
+            const [{ output, duration, priority, ops }] = await Promise.all([scheduler.execute(code, input, runOptions), ...background]);
+            const { interactive, batch } = scheduler.stats().classes;
+            console.log(`Output: "${output.replace(/\0/g, '\\0')}" (${priority}, ${ops} ops)`);
+            console.log(chalk.yellow(`Latency: ${duration.toFixed(3)} ms (p99 interactive ${interactive.p99.toFixed(3)} ms, batch ${batch.p99.toFixed(3)} ms)`));
+            result = { output, priority };
+        } else if (options.native) {
+            // Native mode goes through the addon (skipped unless built: npm run build:addon)
+            const { native, ...nativeOptions } = options;
+            if (!nativeAvailable()) {
+                console.log(chalk.gray("Skipped: native addon not built"));
+                console.log("");
+                return;
+            }
+            const { output, duration } = await executeNative(code, input, nativeOptions);
+            console.log(`Output: "${output.replace(/\0/g, '\\0')}"`);
+            console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
+            result = { output };
+        } else if (options.sync) {
+            // Sync mode goes through executeSync() (engine is initialized by earlier tests)
+            const { sync, ...syncOptions } = options;
+            const { output, duration } = executeSync(code, input, syncOptions);
+            console.log(`Output: "${output.replace(/\0/g, '\\0')}"`);
+            console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
+            result = { output };
         } else {
-             if (input) console.log(`Input: "${input}"`);
-             if (options && Object.keys(options).length > 0) console.log(`Options: ${JSON.stringify(options)}`);
-             const printableOutput = output.replace(/\0/g, '\\0');
-             console.log(`Output: "${printableOutput}"`);
-             console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
-             console.log(chalk.cyan(`Wasm Heap Size (bytes): Before=${memoryStats.wasmHeapBefore}, After=${memoryStats.wasmHeapAfter}`));
+            // Prewarm compiles the program ahead of the run
+            if (options.prewarm) {
+                delete options.prewarm;
+                await prewarm({ programs: [code] });
+            }
+
+            const { output, duration, memoryStats, cached, tape, tapeOffset, watchpointHit } = await execute(code, input, options);
+            result = { output, cached: !!cached, tape: tape && Array.from(tape), tapeOffset, watchpointHit };
+
+            // Check if debugger requested early exit
+            if (debuggerInstance && debuggerInstance.shouldBreak()) {
+                console.log(chalk.red("Execution was halted by the debugger."));
+            } else {
+                if (input) console.log(`Input: "${input}"`);
+                if (options && Object.keys(options).length > 0) console.log(`Options: ${JSON.stringify(options, (key, value) => (value instanceof ResultCache || value instanceof QuotaManager ? `[${value.constructor.name}]` : value))}`);
+                const printableOutput = output.replace(/\0/g, '\\0');
+                console.log(`Output: "${printableOutput}"`);
+                console.log(chalk.yellow(`Execution Time: ${duration.toFixed(3)} ms`));
+                console.log(chalk.cyan(`Wasm Heap Size (bytes): Before=${memoryStats.wasmHeapBefore}, After=${memoryStats.wasmHeapAfter}`));
+                if (cached) console.log(chalk.green("Served from result cache"));
+                if (tape) console.log(`Tape (from cell ${tapeOffset}): [${Array.from(tape).join(', ')}]`);
+                if (watchpointHit) console.log(chalk.magenta(`Watchpoint ${watchpointHit.watchpoint} (${watchpointHit.kind}) at IP ${watchpointHit.instructionPointer}: cell ${watchpointHit.cell} ${watchpointHit.oldValue} -> ${watchpointHit.newValue}`));
+            }
         }
 
     } catch (error) {
         console.error(chalk.red(`Error: ${error.message}`));
+        result = {
+            error: timeout && Atomics.load(timeout.flag, 0) ? new Error(`Timed out after ${timeout.ms} ms`) : error,
+            tape: error.tape && Array.from(error.tape), // The state a run stopped in (returnTape)
+            tapeOffset: error.tapeOffset
+        };
     } finally {
          // Ensure debugger resources are cleaned up
          if (debuggerInstance) {
             debuggerInstance.closeDebugger();
          }
+         if (timeout) await timeout.stop();
     }
+    check(result, expected);
     console.log("");
 }
 
@@ -99,14 +221,53 @@ async function runTest(title, code, input = '', options = {}) {
 async function runAllTests() {
     console.log(chalk.bold.magenta("Starting Brainfuck VM Tests...\n"));
 
-    await runTest("Test 1: Hello World (Optimized)", helloWorldCode);
-    await runTest("Test 2: Echo Input (Optimized)", echoCode, "Echo test!");
-    await runTest("Test 3: Memory Test (Optimized)", memoryTestCode, '', { memorySize: DEFAULT_MEMORY_SIZE });
+    await runTest("Test 1: Hello World (Optimized)", helloWorldCode, '', {}, { output: "Hello World!\n" });
+    await runTest("Test 2: Echo Input (Optimized)", echoCode, "Echo test!", {}, { output: "Echo test!\0" });
+    await runTest("Test 3: Memory Test (Optimized)", memoryTestCode, '', { memorySize: DEFAULT_MEMORY_SIZE }, { output: "0" });
+    await runTest("Test 4: Closed-Form Loops (Non-Unit Steps)", closedFormLoopCode, '', {}, { output: "AW" });
+    await runTest("Test 5: Nested Multiply Loop (Flattened)", nestedLoopCode, '', {}, { output: "v" });
+    await runTest("Test 6: Bulk Clear/Set Run", clearRunCode, '', {}, { output: "!\"#" });
+    await runTest("Test 9: Hello World (Interpreter Engine)", helloWorldCode, '', { engine: 'interpreter' }, { output: "Hello World!\n" });
+    await runTest("Test 10: Hello World (Trace Engine)", helloWorldCode, '', { engine: 'trace' }, { output: "Hello World!\n" });
+    const resultCache = new ResultCache({ maxBytes: 1024 * 1024 });
+    await runTest("Test 11: Result Cache (Miss)", helloWorldCode, '', { cache: resultCache }, { output: "Hello World!\n", cached: false });
+    await runTest("Test 12: Result Cache (Hit)", helloWorldCode, '', { cache: resultCache }, { output: "Hello World!\n", cached: true });
+    await runTest("Test 13: Infinite Loop (Hang Detection)", '+[>+<]', '', { detectHangs: true, harnessTimeoutMs: 5000 }, { error: -12 });
+    await runTest("Test 14: Per-Line Records (Worker Threads)", upperCaseLineCode, "abc\nhello\nxyz\n", { records: true, workers: 2 }, { output: "ABC\nHELLO\nXYZ\n", records: 3 });
+    await runTest("Test 15: Cancelled Run (Aborted Signal)", '+[]', '', { signal: AbortSignal.abort() }, { error: -13 });
+    await runTest("Test 16: Hello World (executeSync)", helloWorldCode, '', { sync: true }, { output: "Hello World!\n" });
+    await runTest("Test 17: Nested Multiply Loop (Prewarmed)", nestedLoopCode, '', { prewarm: true }, { output: "v" });
+    await runTest("Test 18: Large Tape (Disposable Instance)", memoryTestCode, '', { memorySize: 128 * 1024 * 1024 }, { output: "0" });
+    await runTest("Test 19: Hello World (Native Addon, Threadpool)", helloWorldCode, '', { native: true }, { output: "Hello World!\n" });
+    await runTest("Test 20: Per-Input Batch (Threads Build)", upperCaseLineCode, ["abc\n", "hello\n", "xyz\n"], { batch: true }, { outputs: ["ABC\n", "HELLO\n", "XYZ\n"] });
+    await runTest("Test 21: Per-Input Batch (Lockstep Lanes)", helloWorldCode + ",.", ["a", "b", "c", "d"], { batch: true, lockstep: true },
+        { outputs: ["a", "b", "c", "d"].map(c => "Hello World!\n" + c) });
+    await runTest("Test 22: Interactive Beside Batch (Scheduler)", helloWorldCode, '', { scheduler: createScheduler(), tenant: 'web' }, { output: "Hello World!\n" });
+    const quota = new QuotaManager({ limits: { ops: 1 } }); // Admits one run per minute
+    await runTest("Test 23: Tenant Quota (Admitted)", helloWorldCode, '', { quota, tenant: 'trial' }, { output: "Hello World!\n" });
+    await runTest("Test 24: Tenant Quota (Over Quota, Rejected)", helloWorldCode, '', { quota, tenant: 'trial' }, { error: 'ERR_QUOTA_EXCEEDED' });
+    await runTest("Test 25: Final Tape (Touched Range, View)", nestedLoopCode, '', { returnTape: 'view', tapeRange: 'touched' }, { output: "v", tape: [10, 0, 118], tapeOffset: 2 });
+    // Skips the ',' prologue: "hi!" is preloaded into cells 1-3 and the run starts at the print loop
+    await runTest("Test 26: Preloaded Tape (startIp Past Prologue)", ">,>,>,[<]>[.>]", '', { initialTape: Buffer.from("hi!"), initialTapeOffset: 1, startIp: 6, startDp: 3 }, { output: "hi!" });
+    // Stops at the first write to cell 3 (inside the flattened multiply loop), tape as it was then
+    await runTest("Test 27: Watchpoint (Write to Cell 3)", nestedLoopCode, '', { watchpoints: [{ start: 3, on: 'write' }], returnTape: 'copy', tapeRange: 'touched' },
+        { output: "", tape: [63, 9, 1], tapeOffset: 1, watchpointHit: { instructionPointer: 39, cell: 3, watchpoint: 0, kind: 'write', oldValue: 0, newValue: 1 } });
+    // The callback reads the live tape each step and halts once cell 1 reaches 2
+    await runTest("Test 28: Debug Step Reads the Tape (Halt)", simpleLoopCode, '', { singleStep: true, onDebugStep: ({ tape }) => tape[1] === 2, returnTape: 'copy', tapeRange: 'touched' },
+        { error: -9, tape: [1, 2], tapeOffset: 0 });
+    // 'a' never leaves the loop; the batch's timeout stops it
+    await runTest("Test 29: Per-Input Batch (Timeout)", ',[]', ['', 'a'], { batch: true, timeoutMs: 200 }, { error: -13 });
+    // The divmod loop is hot, balanced and within 8 cells: its trace runs on cached cells
+    await runTest("Test 30: Divmod Loop (Trace Engine, Cached Cells)", divmodCode, '', { engine: 'trace-cached' }, { output: "4L" });
     // ... (other existing tests)
-    await runTest("Test 7: Error - Unmatched Bracket (Pre-scan)", badCodeUnmatchedOpen); // Error msg might change
-    await runTest("Test 8: Error - Memory Out of Bounds (Start)", badCodeOOB);
+    await runTest("Test 7: Error - Unmatched Bracket (Pre-scan)", badCodeUnmatchedOpen, '', {}, { error: -5 });
+    await runTest("Test 8: Error - Memory Out of Bounds (Start)", badCodeOOB, '', {}, { error: -1 });
 
     console.log(chalk.bold.magenta("...Tests Finished.\n"));
+    if (failures > 0) {
+        console.log(chalk.red(`${failures} test${failures === 1 ? '' : 's'} failed.`));
+        process.exitCode = 1;
+    }
 }
 
 runAllTests();
\ No newline at end of file